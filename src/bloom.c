@@ -1,97 +1,499 @@
 
 #include <assert.h>
 #include <string.h>
-#include <pthread.h>
 
 #include "bloom.h"
 #include "misc.h"
 
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#if HAVE_MBIND
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <numaif.h>
+#endif
+
+#if HAVE_AVX2 || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 
 /* the number of subtables, hard-coded so I can use stack space in a few places
  * */
 #define NUM_SUBTABLES 4
 
-/* careful, these numbers should not be changed independent of each other */
-static const size_t   fingerprint_bits = 14;
-static const uint32_t fingerprint_mask = 0xfffc00;
-static const size_t   counter_bits     = 10;
-static const uint32_t counter_mask     = 0x0003ff;
-static const size_t   cell_bytes       = 3;
-static const size_t   blocks_per_lock  = 16;
+/* Each cell is one aligned 32-bit word holding a fingerprint in the high bits
+ * and a counter in the low bits, so that cells can be claimed, incremented,
+ * and cleared with a single compare-and-swap rather than taking a lock.
+ *
+ * Where the word is split is chosen when the filter is allocated, from the
+ * formats in cell_formats below: more counter bits saturate later, more
+ * fingerprint bits mean fewer false positives. */
+#define COUNTER_MASK(counter_bits)     (((uint32_t) 1 << (counter_bits)) - 1)
+#define FINGERPRINT_MASK(counter_bits) (~COUNTER_MASK(counter_bits))
+
+/* Functions taking counter_bits as an argument on the hot path are forced
+ * inline into a specialization for each cell format, where it's a constant. */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
 
 
-static uint32_t get_cell_count(uint8_t* c)
+/* A fingerprint of zero marks an empty cell, so keys hashing to it are given
+ * the smallest non-zero fingerprint instead. */
+static ALWAYS_INLINE uint32_t get_fingerprint(uint64_t h,
+                                              unsigned int counter_bits)
 {
-    return (*(uint32_t*) c) & counter_mask;
+    uint32_t fp = (uint32_t) h & FINGERPRINT_MASK(counter_bits);
+    return fp == 0 ? (uint32_t) 1 << counter_bits : fp;
 }
 
 
-static void set_cell_count(uint8_t* c, uint32_t cnt)
+static uint32_t load_cell(const uint32_t* c)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+
+/* Replace the cell with `desired` if it still holds `*expected`. On failure
+ * `*expected` is updated to the current contents of the cell. */
+static bool cas_cell(uint32_t* c, uint32_t* expected, uint32_t desired)
+{
+    return __atomic_compare_exchange_n(c, expected, desired, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+/* Bucket scanners, comparing a fingerprint against every cell in a bucket of
+ * m cells at once, where fingerprints are the bits of the cell under fpmask.
+ *
+ * Returns:
+ *   A mask of the cells holding the fingerprint fp, with the mask of empty
+ *   cells output to empty. Bit j corresponds to cell j, so buckets may hold at
+ *   most 32 cells.
+ *
+ * The cells are not read atomically as a whole, only one by one, so the
+ * result is only a hint under concurrent updates: a matching cell has to be
+ * loaded again before it's used.
+ */
+typedef uint32_t (*bucket_scan_t)(const uint32_t*, size_t, uint32_t, uint32_t,
+                                  uint32_t*);
+
+
+static uint32_t bucket_scan_scalar(const uint32_t* bucket, size_t m,
+                                   uint32_t fpmask, uint32_t fp,
+                                   uint32_t* empty)
 {
-    (*(uint32_t*) c) = ((*(uint32_t*) c) & fingerprint_mask) | (cnt & counter_mask);
+    uint32_t match = 0, c;
+    size_t j;
+    *empty = 0;
+    for (j = 0; j < m; ++j) {
+        c = load_cell(&bucket[j]) & fpmask;
+        if      (c == fp) match  |= (uint32_t) 1 << j;
+        else if (c == 0)  *empty |= (uint32_t) 1 << j;
+    }
+
+    return match;
+}
+
+
+#ifdef __SSE2__
+static uint32_t bucket_scan_sse2(const uint32_t* bucket, size_t m,
+                                 uint32_t fpmask, uint32_t fp, uint32_t* empty)
+{
+    const __m128i fpmaskv = _mm_set1_epi32((int32_t) fpmask);
+    const __m128i fpv = _mm_set1_epi32((int32_t) fp);
+    const __m128i zero = _mm_setzero_si128();
+
+    uint32_t match = 0, e = 0;
+    __m128i c;
+    size_t j;
+    for (j = 0; j + 4 <= m; j += 4) {
+        c = _mm_and_si128(_mm_load_si128((const __m128i*) &bucket[j]), fpmaskv);
+        match |= (uint32_t) _mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpeq_epi32(c, fpv))) << j;
+        e |= (uint32_t) _mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpeq_epi32(c, zero))) << j;
+    }
+
+    if (j < m) {
+        uint32_t tail_empty;
+        match |= bucket_scan_scalar(bucket + j, m - j, fpmask, fp,
+                                    &tail_empty) << j;
+        e |= tail_empty << j;
+    }
+
+    *empty = e;
+    return match;
+}
+#endif
+
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static uint32_t bucket_scan_avx2(const uint32_t* bucket, size_t m,
+                                 uint32_t fpmask, uint32_t fp, uint32_t* empty)
+{
+    const __m256i fpmaskv = _mm256_set1_epi32((int32_t) fpmask);
+    const __m256i fpv = _mm256_set1_epi32((int32_t) fp);
+    const __m256i zero = _mm256_setzero_si256();
+
+    uint32_t match = 0, e = 0;
+    __m256i c;
+    size_t j;
+    for (j = 0; j + 8 <= m; j += 8) {
+        c = _mm256_and_si256(
+                _mm256_load_si256((const __m256i*) &bucket[j]), fpmaskv);
+        match |= (uint32_t) _mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(c, fpv))) << j;
+        e |= (uint32_t) _mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(c, zero))) << j;
+    }
+
+    if (j < m) {
+        uint32_t tail_empty;
+        match |= bucket_scan_scalar(bucket + j, m - j, fpmask, fp,
+                                    &tail_empty) << j;
+        e |= tail_empty << j;
+    }
+
+    *empty = e;
+    return match;
 }
+#endif
+
+
+/* Pick the best bucket scanner the CPU supports. The vectorized ones need
+ * buckets aligned to their width, which holds for buckets of a multiple of 8
+ * cells in a cache line aligned table. */
+static bucket_scan_t get_bucket_scan(size_t m)
+{
+    bucket_scan_t f = bucket_scan_scalar;
+    if (m % 8 != 0) return f;
+
+#ifdef __SSE2__
+    f = bucket_scan_sse2;
+#endif
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) f = bucket_scan_avx2;
+#endif
+
+    return f;
+}
+
+
+/* A cell format, with specializations of the hot functions for it (see
+ * cell_formats). */
+typedef struct bloom_cell_format_t_
+{
+    unsigned int counter_bits;
+
+    bool (*find)(const bloom_t*, uint64_t, uint32_t* const*,
+                 uint32_t**, uint32_t*);
+
+    unsigned int (*add)(const bloom_t*, uint64_t, uint32_t* const*,
+                        unsigned int, unsigned int);
+} bloom_cell_format_t;
 
 
 struct bloom_t_
 {
-    /* pointers into T, to save a little computation */
-    uint8_t* subtables[NUM_SUBTABLES];
+    /* all cells, in one allocation */
+    uint32_t* T;
 
-    /* Mutexes each locking a group of blocks_per_lock */
-    pthread_mutex_t* mutexes[NUM_SUBTABLES];
+    /* false if T belongs to someone else, e.g., is memory mapped */
+    bool owns_T;
+
+    /* if T was allocated with bloom_alloc_table, the size of the mapping, or
+     * 0 if it was allocated with malloc */
+    size_t map_size;
+
+    /* pointers into T, to save a little computation */
+    uint32_t* subtables[NUM_SUBTABLES];
 
     /* number of buckets per subtable */
     size_t n;
 
     /* number of cells per bucket */
     size_t m;
+
+    /* The filter is divided into 2^slice_bits slices, each made up of an equal
+     * range of buckets in every subtable. The top slice_bits bits of a key's
+     * hash choose its slice, which holds all of its buckets, so keys can be
+     * inserted a slice at a time (see bloom_slice). slice_mask covers those
+     * bits. */
+    unsigned int slice_bits;
+    uint64_t slice_mask;
+
+    /* bucket scanner suited to m and the CPU */
+    bucket_scan_t scan;
+
+    /* how cells are split between fingerprint and counter */
+    const bloom_cell_format_t* fmt;
 };
 
 
 
-bloom_t* bloom_alloc(size_t n, size_t m)
+/* Tables are aligned to cache lines, so that a bucket the size of a line (see
+ * cells_per_bucket in dbg.c) is read with one memory access. */
+static const size_t cache_line_size = 64;
+
+
+/* Slices are made as small as possible, however large the filter, so a slice
+ * fits in a core's share of the cache, but no smaller than this, so that
+ * d-left placement, which balances keys between buckets of a slice, still has
+ * plenty to choose from. */
+static const size_t min_slice_size = 1 << 20;
+
+
+static void bloom_init_slices(bloom_t* B)
+{
+    size_t size = NUM_SUBTABLES * B->n * B->m * sizeof(uint32_t);
+    B->slice_bits = 0;
+    while (size >> (B->slice_bits + 1) >= min_slice_size) {
+        ++B->slice_bits;
+    }
+
+    B->slice_mask = B->slice_bits == 0 ? 0 : ~(UINT64_MAX >> B->slice_bits);
+}
+
+
+/* Tables at least this large are mapped directly, so they can be backed by
+ * huge pages, and are rounded up to a multiple of it: the 2MB huge page. */
+static const size_t min_map_size = 1 << 21;
+
+/* MAP_HUGETLB otherwise uses the system's default huge page size, which may be
+ * 1GB, and a mapping that isn't a multiple of it can't be unmapped or dropped,
+ * so 2MB pages are asked for explicitly (MAP_HUGE_2MB is missing from libc's
+ * headers). */
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+#define MAP_HUGETLB_2MB (MAP_HUGETLB | (21 << MAP_HUGE_SHIFT))
+#endif
+
+
+#if HAVE_MBIND
+/* Set the bits in nodemask of the NUMA nodes that are online, as listed in
+ * sysfs, e.g. "0-3,6". Returns the number of nodes, or 0 if the list can't be
+ * read. Nodes past the width of the mask are left out. */
+static size_t get_online_nodes(unsigned long* nodemask)
+{
+    *nodemask = 0;
+
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL) return 0;
+
+    char buf[256];
+    bool ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+    if (!ok) return 0;
+
+    const size_t max_nodes = 8 * sizeof(unsigned long);
+    size_t num_nodes = 0;
+    unsigned long u, v;
+    char* p = buf;
+    char* q;
+    while (true) {
+        u = v = strtoul(p, &q, 10);
+        if (q == p) break;
+        if (*q == '-') {
+            p = q + 1;
+            v = strtoul(p, &q, 10);
+            if (q == p) break;
+        }
+
+        for (; u <= v && u < max_nodes; ++u) {
+            *nodemask |= 1UL << u;
+            ++num_nodes;
+        }
+
+        if (*q != ',') break;
+        p = q + 1;
+    }
+
+    return num_nodes;
+}
+#endif
+
+
+/* Allocate a zeroed table of the given size, for a filter or a bloom_bits_t,
+ * setting map_size to the size of the mapping, or 0 if it was malloc'd.
+ *
+ * Large tables are anonymous mappings, backed by huge pages when possible,
+ * since probes are random and would otherwise miss the TLB nearly every
+ * time. The table is not touched here: the kernel zeroes pages as they are
+ * first written, so the work is spread over the threads adding k-mers rather
+ * than done up front, and each page lands on the NUMA node of the thread that
+ * first uses it. Where mbind is available, pages are instead interleaved
+ * across all nodes, since every thread probes every part of the table.
+ */
+static void* bloom_alloc_table(size_t size, size_t* map_size_out)
 {
-    bloom_t* B = malloc(sizeof(bloom_t));
+    *map_size_out = 0;
+
+#if HAVE_MMAP
+    if (size >= min_map_size) {
+        size_t map_size = (size + min_map_size - 1) & ~(min_map_size - 1);
+        void* T = MAP_FAILED;
+
+#ifdef MAP_HUGETLB_2MB
+        /* Without MAP_NORESERVE, this fails up front, rather than faulting
+         * later, if not enough huge pages are reserved. */
+        T = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB_2MB, -1, 0);
+#endif
+
+        /* No huge pages are reserved, so settle for transparent ones. */
+        if (T == MAP_FAILED) {
+            T = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (T != MAP_FAILED) madvise(T, map_size, MADV_HUGEPAGE);
+#endif
+        }
+
+        if (T != MAP_FAILED) {
+#if HAVE_MBIND
+            /* Interleaving one node would change nothing. On failure we are
+             * left with first-touch placement. */
+            unsigned long nodemask;
+            if (get_online_nodes(&nodemask) > 1 &&
+                mbind(T, map_size, MPOL_INTERLEAVE, &nodemask,
+                      8 * sizeof(unsigned long), 0) != 0) {
+                fprintf(stderr, "Warning: can not interleave the table across "
+                                "NUMA nodes: %s\n", strerror(errno));
+            }
+#endif
+            *map_size_out = map_size;
+            return T;
+        }
+    }
+#endif
+
+    void* T = aligned_malloc_or_die(cache_line_size, size);
+    memset(T, 0, size);
+    return T;
+}
+
+
+static void bloom_free_table(void* T, size_t map_size)
+{
+#if HAVE_MMAP
+    if (map_size > 0) munmap(T, map_size);
+    else free(T);
+#else
+    (void) map_size;
+    free(T);
+#endif
+}
+
+
+static const bloom_cell_format_t* get_cell_format(unsigned int counter_bits);
+
+
+bloom_t* bloom_alloc(size_t n, size_t m, unsigned int counter_bits)
+{
+    assert(m <= 32);
+
+    bloom_t* B = malloc_or_die(sizeof(bloom_t));
     B->n = n;
     B->m = m;
+    B->scan = get_bucket_scan(m);
+    B->fmt = get_cell_format(counter_bits);
+    bloom_init_slices(B);
 
-    size_t subtable_size = n * m * cell_bytes;
-    /* this is ceiling(n * m / blocks_per_lock) */
-    size_t mutex_count = (n * m + blocks_per_lock - 1) / blocks_per_lock;
+    size_t size = NUM_SUBTABLES * n * m * sizeof(uint32_t);
+    B->T = bloom_alloc_table(size, &B->map_size);
+    B->owns_T = true;
 
-    size_t i, j;
+    size_t i;
     for (i = 0; i < NUM_SUBTABLES; ++i) {
-        B->subtables[i] = malloc_or_die(subtable_size);
-        memset(B->subtables[i], 0, subtable_size);
+        B->subtables[i] = B->T + i * n * m;
+    }
 
-        B->mutexes[i] = malloc_or_die(mutex_count * sizeof(pthread_mutex_t));
-        for (j = 0; j < mutex_count; ++j) {
-            pthread_mutex_init_or_die(&B->mutexes[i][j], NULL);
-        }
+    return B;
+}
+
+
+bloom_t* bloom_alloc_data(void* data, size_t n, size_t m,
+                          unsigned int counter_bits)
+{
+    assert(m <= 32);
+
+    bloom_t* B = malloc_or_die(sizeof(bloom_t));
+    B->n = n;
+    B->m = m;
+    B->scan = get_bucket_scan(m);
+    B->fmt = get_cell_format(counter_bits);
+    bloom_init_slices(B);
+    B->T = data;
+    B->owns_T = false;
+    B->map_size = 0;
+
+    size_t i;
+    for (i = 0; i < NUM_SUBTABLES; ++i) {
+        B->subtables[i] = B->T + i * n * m;
     }
 
     return B;
 }
 
 
+const void* bloom_data(const bloom_t* B, size_t* size)
+{
+    *size = NUM_SUBTABLES * B->n * B->m * sizeof(uint32_t);
+    return B->T;
+}
+
+
+size_t bloom_num_buckets(const bloom_t* B)
+{
+    return B->n;
+}
+
+
+size_t bloom_bucket_size(const bloom_t* B)
+{
+    return B->m;
+}
+
+
+size_t bloom_num_slices(const bloom_t* B)
+{
+    return (size_t) 1 << B->slice_bits;
+}
+
+
+size_t bloom_slice(const bloom_t* B, kmer_hash128_t h)
+{
+    return B->slice_bits == 0 ? 0 : h.hi >> (64 - B->slice_bits);
+}
+
+
+unsigned int bloom_counter_bits(const bloom_t* B)
+{
+    return B->fmt->counter_bits;
+}
+
+
 bloom_t* bloom_copy(const bloom_t* B)
 {
     bloom_t* C = malloc_or_die(sizeof(bloom_t));
     C->n = B->n;
     C->m = B->m;
+    C->scan = B->scan;
+    C->fmt = B->fmt;
+    C->slice_bits = B->slice_bits;
+    C->slice_mask = B->slice_mask;
 
-    size_t subtable_size = C->n * C->m * cell_bytes;
-    size_t mutex_count = (C->n * C->m + blocks_per_lock - 1) / blocks_per_lock;
+    size_t size = NUM_SUBTABLES * C->n * C->m * sizeof(uint32_t);
+    C->T = bloom_alloc_table(size, &C->map_size);
+    C->owns_T = true;
+    memcpy(C->T, B->T, size);
 
-    size_t i, j;
+    size_t i;
     for (i = 0; i < NUM_SUBTABLES; ++i) {
-        C->subtables[i] = malloc_or_die(subtable_size);
-        memcpy(C->subtables[i], B->subtables[i], subtable_size);
-
-        C->mutexes[i] = malloc_or_die(mutex_count * sizeof(pthread_mutex_t));
-        for (j = 0; j < mutex_count; ++j) {
-            pthread_mutex_init_or_die(&C->mutexes[i][j], NULL);
-        }
+        C->subtables[i] = C->T + i * C->n * C->m;
     }
 
     return C;
@@ -100,112 +502,328 @@ bloom_t* bloom_copy(const bloom_t* B)
 
 void bloom_clear(bloom_t* B)
 {
-    size_t i;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        memset(B->subtables[i], 0, B->n * B->m * cell_bytes);
+#if HAVE_MMAP
+    /* Dropping the pages has them zeroed again when next touched. */
+    if (B->map_size > 0 && madvise(B->T, B->map_size, MADV_DONTNEED) == 0) {
+        return;
     }
+#endif
+    memset(B->T, 0, NUM_SUBTABLES * B->n * B->m * sizeof(uint32_t));
 }
 
 
 void bloom_free(bloom_t* B)
 {
     if (B == NULL) return;
+    if (B->owns_T) bloom_free_table(B->T, B->map_size);
+    free(B);
+}
 
-    size_t mutex_count = (B->n * B->m + blocks_per_lock - 1) / blocks_per_lock;
-    size_t i, j;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        free(B->subtables[i]);
 
-        for (j = 0; j < mutex_count; ++j) {
-            pthread_mutex_destroy(&B->mutexes[i][j]);
-        }
-        free(B->mutexes[i]);
+/* Compute the bucket a key with hash h falls in, in each subtable, and
+ * prefetch them.
+ *
+ * The fingerprint is h.lo, so the subtable indices have to come mostly from
+ * h.hi. Rather than mixing further, index i is taken from h.hi + i * h.lo,
+ * which is as good for our purposes as independent hashes. See: Kirsch, A., &
+ * Mitzenmacher, M. (2006). Less hashing, same performance: building a better
+ * bloom filter. ESA 2006, LNCS 4168 (pp. 456-467).
+ *
+ * The top bits are kept from h.hi in every subtable, so, since fastrange64 is
+ * monotonic, all the buckets fall in the key's slice.
+ */
+static void bloom_buckets(const bloom_t* B, kmer_hash128_t h,
+                          uint32_t* buckets[NUM_SUBTABLES])
+{
+    uint64_t slice = h.hi & B->slice_mask;
+    uint64_t g;
+    size_t i;
+    for (i = 0; i < NUM_SUBTABLES; ++i) {
+        g = slice | ((h.hi + i * h.lo) & ~B->slice_mask);
+        buckets[i] = &B->subtables[i][fastrange64(g, B->n) * B->m];
+        prefetch(buckets[i], 0, 0);
     }
-
-    free(B);
 }
 
 
-/* Find the subtable i and cell j containing the given key x.
+/* Find the cell containing the key whose hash has low word h, given the
+ * buckets computed by bloom_buckets.
  *
  * Args:
  *   B: A bloom fliter.
- *   x: The kmer to finde.
- *   i_: If located, the index of the subtable is output here.
- *   j_: If located, the offset into the subtable is output here.
- *   locket_mutex: If the find was successful, this is set to a locked mutex
- *                  protecting the location of the key. The caller is
- *                  responsible for unlocking.
+ *   h: The low word of the key's hash.
+ *   buckets: The key's buckets.
+ *   cell: If located, a pointer to the cell is output here.
+ *   value: If located, the contents of the cell when it was found.
+ *   counter_bits: The cell format.
+ *
  * Returns:
  *   true if the key was found.
  */
-static bool bloom_find(const bloom_t* B, kmer_t x,
-                       size_t* i_, size_t* j_,
-                       pthread_mutex_t** locked_mutex)
+static ALWAYS_INLINE bool bloom_find_hashed(
+        const bloom_t* B, uint64_t h, uint32_t* const buckets[NUM_SUBTABLES],
+        uint32_t** cell, uint32_t* value, unsigned int counter_bits)
 {
-    const size_t bytes_per_bucket = B->m * cell_bytes;
-
-    uint64_t h1, h0 = kmer_hash(x);
-    uint32_t fp = h0 & (uint64_t) fingerprint_mask;
-    uint64_t hs[NUM_SUBTABLES];
+    const uint32_t fpmask = FINGERPRINT_MASK(counter_bits);
+    uint32_t fp = get_fingerprint(h, counter_bits);
 
-    h1 = h0;
-    size_t i;
+    uint32_t c, match, empty;
+    size_t i, j;
     for (i = 0; i < NUM_SUBTABLES; ++i) {
-        h1 = hs[i] = kmer_hash_mix(h0, h1);
-        hs[i] %= B->n;
-        prefetch(&B->subtables[i][hs[i] * bytes_per_bucket], 0, 0);
-        prefetch(&B->mutexes[i][hs[i] / blocks_per_lock], 0, 0);
+        match = B->scan(buckets[i], B->m, fpmask, fp, &empty);
+        while (match) {
+            j = __builtin_ctz(match);
+            c = load_cell(&buckets[i][j]);
+            if ((c & fpmask) == fp) {
+                *cell = &buckets[i][j];
+                *value = c;
+                return true;
+            }
+            match &= match - 1;
+        }
     }
 
-    uint8_t *c, *c_start, *c_end;
+    return false;
+}
+
+
+/* Add d to the count for the key whose hash has low word h, given the buckets
+ * computed by bloom_buckets, or, if the key is new, give it count d0.
+ *
+ * Returns:
+ *   The new count for the cell, or 0 if there was not space to place it.
+ */
+static ALWAYS_INLINE unsigned int bloom_add_hashed(
+        const bloom_t* B, uint64_t h, uint32_t* const buckets[NUM_SUBTABLES],
+        unsigned int d, unsigned int d0, unsigned int counter_bits)
+{
+    /* We can't quite use bloom_find_hashed here since we have to keep track
+     * of candidate cells. */
+
+    const uint32_t fpmask = FINGERPRINT_MASK(counter_bits);
+    const uint32_t counter_mask = COUNTER_MASK(counter_bits);
+    uint32_t fp = get_fingerprint(h, counter_bits);
+
+    uint32_t* cells[NUM_SUBTABLES];
+    size_t bucket_sizes[NUM_SUBTABLES];
+
+    size_t m = B->m;
+    uint32_t count, c, match, empty;
+    size_t i, j;
+
+retry:
     for (i = 0; i < NUM_SUBTABLES; ++i) {
-        *locked_mutex = &B->mutexes[i][hs[i] / blocks_per_lock];
-        pthread_mutex_lock(*locked_mutex);
+        match = B->scan(buckets[i], m, fpmask, fp, &empty);
+
+        /* Key found. */
+        if (match) {
+            j = __builtin_ctz(match);
+            uint32_t expected = load_cell(&buckets[i][j]);
+            if ((expected & fpmask) != fp) goto retry;
+
+            do {
+                count = expected & counter_mask;
+                c = expected & ~counter_mask;
+                if (count + d < counter_mask) c |= count + d;
+                else                          c |= counter_mask;
+            } while (!cas_cell(&buckets[i][j], &expected, c) &&
+                     (expected & fpmask) == fp);
+
+            /* The cell was cleared out from under us. */
+            if ((expected & fpmask) != fp) goto retry;
+
+            return count + d < counter_mask ? count + d : counter_mask;
+        }
+        /* Candidate cell found. */
+        else if (empty) {
+            j = __builtin_ctz(empty);
+            cells[i] = &buckets[i][j];
+            bucket_sizes[i] = j;
+        }
+        /* full bucket */
+        else {
+            cells[i] = NULL;
+            bucket_sizes[i] = m;
+        }
+    }
+
+    /* Find the least-full bucket, breaking ties to the left. (i.e., "d-left"
+     * hashing). */
+    size_t i_min = NUM_SUBTABLES;
+    size_t min_bucket_size = m;
+    for (i = 0; i < NUM_SUBTABLES && min_bucket_size > 0; ++i) {
+        if (bucket_sizes[i] < min_bucket_size) {
+            i_min = i;
+            min_bucket_size = bucket_sizes[i];
+        }
+    }
 
-        c = c_start = &B->subtables[i][hs[i] * bytes_per_bucket];
-        c_end = c_start + bytes_per_bucket;
+    /* Full. */
+    if (i_min == NUM_SUBTABLES) return 0;
 
-        /* scan through cells */
-        while (c < c_end) {
-            if (((*(uint32_t*) c) & fingerprint_mask) == fp) {
-                *i_ = i;
-                *j_ = c - B->subtables[i];
-                return true;
-            }
+    /* Claim the cell. If another thread got there first, the key may have just
+     * been inserted, so we have to look again.
+     *
+     * Without locking, two threads inserting the same new key can, rarely,
+     * claim cells in different subtables. The count is then split between
+     * the two cells, which only costs us a little accuracy. */
+    if (d0 > counter_mask) d0 = counter_mask;
+    c = 0;
+    if (!cas_cell(cells[i_min], &c, fp | d0)) goto retry;
+
+    return d0;
+}
+
+
+/* The supported cell formats, each with its own specialization of the
+ * functions above. */
+#define BLOOM_CELL_FORMAT(counter_bits)                                       \
+    static bool bloom_find_##counter_bits(                                    \
+            const bloom_t* B, uint64_t h, uint32_t* const* buckets,           \
+            uint32_t** cell, uint32_t* value)                                 \
+    {                                                                         \
+        return bloom_find_hashed(B, h, buckets, cell, value, counter_bits);   \
+    }                                                                         \
+                                                                              \
+    static unsigned int bloom_add_##counter_bits(                             \
+            const bloom_t* B, uint64_t h, uint32_t* const* buckets,           \
+            unsigned int d, unsigned int d0)                                  \
+    {                                                                         \
+        return bloom_add_hashed(B, h, buckets, d, d0, counter_bits);          \
+    }
 
-            c += cell_bytes;
+BLOOM_CELL_FORMAT(6)
+BLOOM_CELL_FORMAT(8)
+BLOOM_CELL_FORMAT(10)
+BLOOM_CELL_FORMAT(12)
+BLOOM_CELL_FORMAT(16)
+
+#define CELL_FORMAT(counter_bits) \
+    {counter_bits, bloom_find_##counter_bits, bloom_add_##counter_bits}
+
+static const bloom_cell_format_t cell_formats[] =
+{
+    CELL_FORMAT(6),
+    CELL_FORMAT(8),
+    CELL_FORMAT(10),
+    CELL_FORMAT(12),
+    CELL_FORMAT(16)
+};
+
+static const size_t num_cell_formats =
+    sizeof(cell_formats) / sizeof(bloom_cell_format_t);
+
+
+static const bloom_cell_format_t* get_cell_format(unsigned int counter_bits)
+{
+    size_t i;
+    for (i = 0; i < num_cell_formats; ++i) {
+        if (cell_formats[i].counter_bits == counter_bits) {
+            return &cell_formats[i];
         }
+    }
 
-        pthread_mutex_unlock(*locked_mutex);
+    fprintf(stderr, "Unsupported number of counter bits: %u (must be one of",
+            counter_bits);
+    for (i = 0; i < num_cell_formats; ++i) {
+        fprintf(stderr, " %u", cell_formats[i].counter_bits);
     }
+    fputs(").\n", stderr);
+    exit(EXIT_FAILURE);
+}
 
-    *locked_mutex = NULL;
-    return false;
+
+/* Find the cell containing the given key x, as bloom_find_hashed. */
+static bool bloom_find(const bloom_t* B, kmer_t x,
+                       uint32_t** cell, uint32_t* value)
+{
+    uint32_t* buckets[NUM_SUBTABLES];
+    kmer_hash128_t h = kmer_hash128(x);
+    bloom_buckets(B, h, buckets);
+    return B->fmt->find(B, h.lo, buckets, cell, value);
 }
 
 
-unsigned int bloom_get(bloom_t* B, kmer_t x)
+unsigned int bloom_get(const bloom_t* B, kmer_t x)
 {
-    pthread_mutex_t* mutex;
-    size_t i, j;
-    if (bloom_find(B, x, &i, &j, &mutex)) {
-        size_t count = get_cell_count(&B->subtables[i][j]);
-        pthread_mutex_unlock(mutex);
-        return count;
+    uint32_t* cell;
+    uint32_t c;
+    if (bloom_find(B, x, &cell, &c)) {
+        return c & COUNTER_MASK(B->fmt->counter_bits);
     }
     else return 0;
 }
 
 
+struct bloom_visited_t_
+{
+    /* one bit for each cell in B->T */
+    uint64_t* bits;
+    size_t n;
+};
+
+
+bloom_visited_t* bloom_visited_alloc(const bloom_t* B)
+{
+    bloom_visited_t* V = malloc_or_die(sizeof(bloom_visited_t));
+    V->n = (NUM_SUBTABLES * B->n * B->m + 63) / 64;
+    V->bits = malloc_or_die(V->n * sizeof(uint64_t));
+    memset(V->bits, 0, V->n * sizeof(uint64_t));
+    return V;
+}
+
+
+void bloom_visited_free(bloom_visited_t* V)
+{
+    if (V == NULL) return;
+    free(V->bits);
+    free(V);
+}
+
+
+unsigned int bloom_get_claimed(const bloom_t* B, const bloom_visited_t* V,
+                               kmer_t x, bool* claimed)
+{
+    uint32_t* cell;
+    uint32_t c;
+    if (bloom_find(B, x, &cell, &c)) {
+        size_t i = cell - B->T;
+        *claimed = (__atomic_load_n(&V->bits[i / 64], __ATOMIC_RELAXED) >>
+                    (i % 64)) & 1;
+        return c & COUNTER_MASK(B->fmt->counter_bits);
+    }
+    else {
+        *claimed = false;
+        return 0;
+    }
+}
+
+
+unsigned int bloom_claim(const bloom_t* B, bloom_visited_t* V, kmer_t x)
+{
+    uint32_t* cell;
+    uint32_t c;
+    if (bloom_find(B, x, &cell, &c)) {
+        size_t i = cell - B->T;
+        uint64_t bit = (uint64_t) 1 << (i % 64);
+        if ((__atomic_fetch_or(&V->bits[i / 64], bit, __ATOMIC_RELAXED) & bit) == 0) {
+            return c & COUNTER_MASK(B->fmt->counter_bits);
+        }
+    }
+
+    return 0;
+}
+
+
 void bloom_del(bloom_t* B, kmer_t x)
 {
-    pthread_mutex_t* mutex;
-    size_t i, j;
-    if (bloom_find(B, x, &i, &j, &mutex)) {
-        uint32_t* c = (uint32_t*) &B->subtables[i][j];
-        *c &= ~(fingerprint_mask | counter_mask);
-        pthread_mutex_unlock(mutex);
+    uint32_t* cell;
+    uint32_t c, fp;
+    if (bloom_find(B, x, &cell, &c)) {
+        /* Retry only while a concurrent update changes the count. */
+        uint32_t fpmask = FINGERPRINT_MASK(B->fmt->counter_bits);
+        fp = c & fpmask;
+        while (!cas_cell(cell, &c, 0) && (c & fpmask) == fp);
     }
 }
 
@@ -229,101 +847,123 @@ unsigned int bloom_inc(bloom_t* B, kmer_t x)
  */
 unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
 {
-    /* We can't quite use bloom_find here since we have to keep track of
-     * candidate cells, and more importantly, keep them locked. */
+    uint32_t* buckets[NUM_SUBTABLES];
+    kmer_hash128_t h = kmer_hash128(x);
+    bloom_buckets(B, h, buckets);
+    return B->fmt->add(B, h.lo, buckets, d, d);
+}
 
-    const size_t bytes_per_bucket = B->m * cell_bytes;
 
-    uint64_t h1, h0 = kmer_hash(x);
-    uint32_t fp = h0 & (uint64_t) fingerprint_mask;
-    uint64_t hs[NUM_SUBTABLES];
+/* Number of keys prefetched ahead of being inserted by bloom_add_batch. */
+#define BLOOM_BATCH_SIZE 32
 
-    h1 = h0;
-    size_t i;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        h1 = hs[i] = kmer_hash_mix(h0, h1);
-        hs[i] %= B->n;
-        prefetch(&B->subtables[i][hs[i] * bytes_per_bucket], 0, 0);
-        prefetch(&B->mutexes[i][hs[i] / blocks_per_lock], 0, 0);
-    }
 
-    uint8_t* cells[NUM_SUBTABLES];
-    size_t bucket_sizes[NUM_SUBTABLES];
-    pthread_mutex_t* locked_mutexes[NUM_SUBTABLES];
-    memset(locked_mutexes, 0, NUM_SUBTABLES * sizeof(pthread_mutex_t*));
+void bloom_add_batch(bloom_t* B, const kmer_hash128_t* hs, size_t n,
+                     unsigned int d0)
+{
+    /* Finding the buckets for the whole batch first gives the prefetches
+     * issued by bloom_buckets time to land before we touch them. */
+    uint32_t* buckets[BLOOM_BATCH_SIZE][NUM_SUBTABLES];
 
-    uint32_t count;
-    uint8_t *c, *c_start, *c_end;
-    uint32_t cell_fp;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        locked_mutexes[i] = &B->mutexes[i][hs[i] / blocks_per_lock];
-        pthread_mutex_lock(locked_mutexes[i]);
+    size_t i, j, batch_size;
+    for (i = 0; i < n; i += batch_size) {
+        batch_size = n - i < BLOOM_BATCH_SIZE ? n - i : BLOOM_BATCH_SIZE;
 
-        c = c_start = &B->subtables[i][hs[i] * bytes_per_bucket];
-        c_end = c_start + bytes_per_bucket;
+        for (j = 0; j < batch_size; ++j) {
+            bloom_buckets(B, hs[i + j], buckets[j]);
+        }
 
-        while (c < c_end) {
-            cell_fp = (*(uint32_t*) c) & fingerprint_mask;
+        for (j = 0; j < batch_size; ++j) {
+            B->fmt->add(B, hs[i + j].lo, buckets[j], 1, d0);
+        }
+    }
+}
 
-            /* Key found. */
-            if (cell_fp == fp) {
-                count = get_cell_count(c);
-                if (count + d < counter_mask) set_cell_count(c, count + d);
-                else set_cell_count(c, counter_mask);
 
-                size_t k;
-                for (k = 0; k <= i; ++k) {
-                    if (locked_mutexes[k]) {
-                        pthread_mutex_unlock(locked_mutexes[k]);
-                    }
-                }
+struct bloom_bits_t_
+{
+    /* levels consecutive arrays of n words */
+    uint64_t* W;
+    size_t n;
+    unsigned int levels;
 
-                return count + d;
-            }
-            /* Candidate cell found. */
-            else if (cell_fp == 0) {
-                cells[i] = c;
-                bucket_sizes[i] = (c - c_start) / cell_bytes;
-                break;
-            }
+    /* the size of W's mapping, or 0, as in bloom_t */
+    size_t map_size;
+};
 
-            c += cell_bytes;
-        }
 
-        /* full bucket */
-        if (c == c_end) {
-            cells[i] = NULL;
-            bucket_sizes[i] = B->m;
-            pthread_mutex_unlock(locked_mutexes[i]);
-            locked_mutexes[i] = NULL;
-        }
-    }
+/* Each key sets this many bits in one word per level. */
+#define BLOOM_BITS_PER_KEY 4
 
-    /* Find the least-full bucket, breaking ties to the left. (i.e., "d-left"
-     * hashing). */
-    size_t i_min = NUM_SUBTABLES;
-    size_t min_bucket_size = B->m;
-    for (i = 0; i < NUM_SUBTABLES && min_bucket_size > 0; ++i) {
-        if (bucket_sizes[i] < min_bucket_size) {
-            i_min = i;
-            min_bucket_size = bucket_sizes[i];
-        }
-    }
 
-    /* Insert if a suitable cell was found. */
-    count = 0;
-    if (i_min < NUM_SUBTABLES) {
-        if (d > counter_mask) d = counter_mask;
-        (*(uint32_t*) cells[i_min]) = fp | d; // figngerprint & count
-        count = d;
-    }
+bloom_bits_t* bloom_bits_alloc(size_t n, unsigned int levels)
+{
+    bloom_bits_t* S = malloc_or_die(sizeof(bloom_bits_t));
+    S->n = n > 0 ? n : 1;
+    S->levels = levels;
+    S->W = bloom_alloc_table(levels * S->n * sizeof(uint64_t), &S->map_size);
+    return S;
+}
 
-    /* Unlock the mutexes. */
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        if (locked_mutexes[i]) pthread_mutex_unlock(locked_mutexes[i]);
+
+void bloom_bits_free(bloom_bits_t* S)
+{
+    if (S == NULL) return;
+    bloom_free_table(S->W, S->map_size);
+    free(S);
+}
+
+
+/* The word a key with hash h falls in at the given level, and the bits it
+ * sets there.
+ *
+ * Keeping a key's bits in one word costs a little in false positives, but
+ * lets a key be tested and set with a single atomic or, and one cache miss.
+ * Levels are indexed by h.lo + level * h.hi, as in bloom_buckets, so that
+ * keys colliding at one level are unlikely to collide at the next. */
+static uint64_t* bloom_bits_word(const bloom_bits_t* S, kmer_hash128_t h,
+                                 unsigned int level, uint64_t* mask)
+{
+    uint64_t g = h.lo + level * h.hi;
+    size_t j;
+    *mask = 0;
+    for (j = 0; j < BLOOM_BITS_PER_KEY; ++j) {
+        *mask |= (uint64_t) 1 << ((g >> (6 * j)) & 63);
     }
 
-    return count;
+    return &S->W[level * S->n + fastrange64(g, S->n)];
 }
 
 
+void bloom_bits_inc_batch(bloom_bits_t* S, const kmer_hash128_t* hs, size_t n,
+                          unsigned int* counts)
+{
+    /* Most keys only get as far as the first level, so only that's
+     * prefetched. */
+    uint64_t* words[BLOOM_BATCH_SIZE];
+    uint64_t masks[BLOOM_BATCH_SIZE];
+
+    uint64_t* w;
+    uint64_t mask;
+    unsigned int level;
+    size_t i, j, batch_size;
+    for (i = 0; i < n; i += batch_size) {
+        batch_size = n - i < BLOOM_BATCH_SIZE ? n - i : BLOOM_BATCH_SIZE;
+
+        for (j = 0; j < batch_size; ++j) {
+            words[j] = bloom_bits_word(S, hs[i + j], 0, &masks[j]);
+            prefetch(words[j], 1, 0);
+        }
+
+        for (j = 0; j < batch_size; ++j) {
+            w = words[j];
+            mask = masks[j];
+            level = 0;
+            while ((__atomic_fetch_or(w, mask, __ATOMIC_RELAXED) & mask) == mask &&
+                   ++level < S->levels) {
+                w = bloom_bits_word(S, hs[i + j], level, &mask);
+            }
+            counts[i + j] = level + 1;
+        }
+    }
+}
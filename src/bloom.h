@@ -28,17 +28,92 @@ typedef struct bloom_t_ bloom_t;
 
 /* Allocate a new counting bloom filter, where n is the number of buckets per
  * table, and m is the number of cells per bucket.
+ *
+ * Each 32-bit cell holds a counter of counter_bits bits, which must be one of
+ * 6, 8, 10, 12, or 16, and a fingerprint of the rest.
  */
-bloom_t* bloom_alloc(size_t n, size_t m);
+bloom_t* bloom_alloc(size_t n, size_t m, unsigned int counter_bits);
+
+/* Create a filter from existing cells (e.g., memory mapped from a saved
+ * filter), of the size and format given by n, m, and counter_bits. The data is
+ * used in place, and not freed with the filter. */
+bloom_t* bloom_alloc_data(void* data, size_t n, size_t m,
+                          unsigned int counter_bits);
 bloom_t* bloom_copy(const bloom_t*);
 void     bloom_clear(bloom_t*);
 void     bloom_free(bloom_t*);
 
+/* The raw cells, and their size in bytes, for saving the filter. */
+const void* bloom_data(const bloom_t*, size_t* size);
+
+size_t bloom_num_buckets(const bloom_t*);
+size_t bloom_bucket_size(const bloom_t*);
+unsigned int bloom_counter_bits(const bloom_t*);
+
+/* The filter is divided into slices of a megabyte or two, with every
+ * key's cells in the slice given by its hash (from kmer_hash128). Keys in the
+ * same slice can be inserted together, with better cache locality. */
+size_t bloom_num_slices(const bloom_t*);
+size_t bloom_slice(const bloom_t*, kmer_hash128_t h);
+
 unsigned int bloom_inc(bloom_t*, kmer_t);
 void         bloom_ldec(bloom_t*, kmer_t);
 unsigned int bloom_add(bloom_t*, kmer_t, unsigned int d);
-unsigned int bloom_get(bloom_t*, kmer_t);
+unsigned int bloom_get(const bloom_t*, kmer_t);
 void         bloom_del(bloom_t*, kmer_t);
 
+/* A set of visited keys, kept as one bit per cell of a filter, so that a
+ * traversal can mark keys without modifying the filter itself. */
+typedef struct bloom_visited_t_ bloom_visited_t;
+
+bloom_visited_t* bloom_visited_alloc(const bloom_t*);
+void             bloom_visited_free(bloom_visited_t*);
+
+/* Atomically mark a key as visited, so that, of several threads claiming the
+ * same key, exactly one succeeds.
+ *
+ * Returns:
+ *   The key's count if this call claimed it, or 0 if it is not present or was
+ *   already claimed.
+ */
+unsigned int bloom_claim(const bloom_t*, bloom_visited_t*, kmer_t);
+
+/* As bloom_get, but also output whether the key has been claimed. */
+unsigned int bloom_get_claimed(const bloom_t*, const bloom_visited_t*,
+                               kmer_t, bool* claimed);
+
+/* Increment the counts of n keys, given by their hashes from kmer_hash128,
+ * with keys not yet present starting at count d0 rather than 1 (e.g., when
+ * their first few occurrences were counted elsewhere).
+ *
+ * With d0 = 1, this is equivalent to calling bloom_inc on each key, but all the
+ * buckets in a batch are prefetched before any are updated, so the cache
+ * misses overlap.
+ */
+void bloom_add_batch(bloom_t*, const kmer_hash128_t* hs, size_t n,
+                     unsigned int d0);
+
+
+/* A plain bloom filter of bits, used to count keys up to a small threshold,
+ * so that keys seen only once or twice (mostly sequencing errors) can be kept
+ * out of the counting filter, for about a byte each rather than a cell.
+ *
+ * It has a level for each count below the threshold: a key is set in a level
+ * once it's present in every level before it.
+ */
+typedef struct bloom_bits_t_ bloom_bits_t;
+
+/* Allocate a filter with the given number of levels, each of n 64-bit words.
+ * A level holds roughly 8 keys per word with a few percent false positives. */
+bloom_bits_t* bloom_bits_alloc(size_t n, unsigned int levels);
+void          bloom_bits_free(bloom_bits_t*);
+
+/* Record an occurrence of each of n keys, given by their hashes, outputting to
+ * counts[i] the number of times the i-th key has been seen, including this
+ * one, which saturates at one more than the number of levels. This is exact,
+ * even under concurrent calls, barring false positives. */
+void bloom_bits_inc_batch(bloom_bits_t*, const kmer_hash128_t* hs, size_t n,
+                          unsigned int* counts);
+
 #endif
 
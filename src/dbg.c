@@ -1,71 +1,182 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "bloom.h"
+#include "crc64.h"
 #include "dbg.h"
 #include "kmercache.h"
 #include "kmerset.h"
 #include "misc.h"
+#include "twobit.h"
+
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 
-/* Kmer stack, used for traversals of the graph. */
-typedef struct kmerstack_t_
+/* Work-stealing k-mer deque, used for traversals of the graph.
+ *
+ * This is the Chase-Lev deque, following the memory orderings given in:
+ *
+ *     Lê, N. M., Pop, A., Cohen, A., & Zappa Nardelli, F. (2013). Correct and
+ *     efficient work-stealing for weak memory models. PPoPP '13 (pp. 69-80).
+ *
+ * Only the owning thread pushes and pops, at the bottom, without locking.
+ * Other threads steal from the top.
+ */
+typedef struct kmerdeque_array_t_
 {
-    kmer_t* xs;  /* kmers */
-    size_t n;    /* number of elements stored. */
-    size_t size; /* size allocated */
-    pthread_mutex_t mutex;
-} kmerstack_t;
+    size_t size; /* a power of two */
+    kmer_t xs[];
+} kmerdeque_array_t;
 
 
-static kmerstack_t* kmerstack_alloc()
+typedef struct kmerdeque_t_
 {
-    kmerstack_t* S = malloc_or_die(sizeof(kmerstack_t));
-    S->n = 0;
-    S->size = 1024;
-    S->xs = malloc_or_die(S->size * sizeof(kmer_t));
-    pthread_mutex_init_or_die(&S->mutex, NULL);
-    return S;
+    int64_t top;
+    int64_t bottom;
+    kmerdeque_array_t* a;
+
+    /* Arrays outgrown by the deque. A thief may still be reading one, so
+     * they are kept until the deque is freed. */
+    kmerdeque_array_t** old;
+    size_t old_n;
+} kmerdeque_t;
+
+
+static kmerdeque_array_t* kmerdeque_array_alloc(size_t size)
+{
+    kmerdeque_array_t* a =
+        malloc_or_die(sizeof(kmerdeque_array_t) + size * sizeof(kmer_t));
+    a->size = size;
+    return a;
 }
 
 
-static void kmerstack_free(kmerstack_t* S)
+static kmerdeque_t* kmerdeque_alloc()
 {
-    pthread_mutex_destroy(&S->mutex);
-    free(S->xs);
-    free(S);
+    kmerdeque_t* Q = malloc_or_die(sizeof(kmerdeque_t));
+    Q->top = Q->bottom = 0;
+    Q->a = kmerdeque_array_alloc(1024);
+    Q->old = NULL;
+    Q->old_n = 0;
+    return Q;
 }
 
 
-static void kmerstack_push(kmerstack_t* S, kmer_t x)
+static void kmerdeque_free(kmerdeque_t* Q)
 {
-    pthread_mutex_lock(&S->mutex);
-    if (S->n == S->size) {
-        S->size *= 2;
-        S->xs = realloc_or_die(S->xs, S->size * sizeof(kmer_t));
+    size_t i;
+    for (i = 0; i < Q->old_n; ++i) free(Q->old[i]);
+    free(Q->old);
+    free(Q->a);
+    free(Q);
+}
+
+
+static kmer_t kmerdeque_array_get(const kmerdeque_array_t* a, int64_t i)
+{
+    return __atomic_load_n(&a->xs[i & (a->size - 1)], __ATOMIC_RELAXED);
+}
+
+
+static void kmerdeque_array_set(kmerdeque_array_t* a, int64_t i, kmer_t x)
+{
+    __atomic_store_n(&a->xs[i & (a->size - 1)], x, __ATOMIC_RELAXED);
+}
+
+
+/* Double the size of Q's array. Only called by the owner. */
+static kmerdeque_array_t* kmerdeque_grow(kmerdeque_t* Q, int64_t t, int64_t b)
+{
+    kmerdeque_array_t* a = Q->a;
+    kmerdeque_array_t* c = kmerdeque_array_alloc(2 * a->size);
+
+    int64_t i;
+    for (i = t; i < b; ++i) {
+        kmerdeque_array_set(c, i, kmerdeque_array_get(a, i));
     }
 
-    S->xs[S->n++] = x;
-    pthread_mutex_unlock(&S->mutex);
+    Q->old = realloc_or_die(Q->old, (Q->old_n + 1) * sizeof(kmerdeque_array_t*));
+    Q->old[Q->old_n++] = a;
+    __atomic_store_n(&Q->a, c, __ATOMIC_RELEASE);
+    return c;
 }
 
 
-static bool kmerstack_pop(kmerstack_t* S, kmer_t* x)
+/* Push to the bottom. Only called by the owner. */
+static void kmerdeque_push(kmerdeque_t* Q, kmer_t x)
 {
-    pthread_mutex_lock(&S->mutex);
-    if (S->n == 0) {
-        pthread_mutex_unlock(&S->mutex);
+    int64_t b = __atomic_load_n(&Q->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&Q->top, __ATOMIC_ACQUIRE);
+    kmerdeque_array_t* a = __atomic_load_n(&Q->a, __ATOMIC_RELAXED);
+
+    if (b - t > (int64_t) a->size - 1) a = kmerdeque_grow(Q, t, b);
+
+    kmerdeque_array_set(a, b, x);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&Q->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+
+/* Pop from the bottom. Only called by the owner. */
+static bool kmerdeque_pop(kmerdeque_t* Q, kmer_t* x)
+{
+    int64_t b = __atomic_load_n(&Q->bottom, __ATOMIC_RELAXED) - 1;
+    kmerdeque_array_t* a = __atomic_load_n(&Q->a, __ATOMIC_RELAXED);
+    __atomic_store_n(&Q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&Q->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        /* Empty. */
+        __atomic_store_n(&Q->bottom, b + 1, __ATOMIC_RELAXED);
         return false;
     }
 
-    *x = S->xs[--S->n];
-    pthread_mutex_unlock(&S->mutex);
+    *x = kmerdeque_array_get(a, b);
+    if (t == b) {
+        /* The last element, which a thief may be after too. */
+        bool won = __atomic_compare_exchange_n(&Q->top, &t, t + 1, false,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_RELAXED);
+        __atomic_store_n(&Q->bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+
     return true;
 }
 
 
+/* Steal from the top. May be called by any thread. */
+static bool kmerdeque_steal(kmerdeque_t* Q, kmer_t* x)
+{
+    int64_t t = __atomic_load_n(&Q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&Q->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) return false;
+
+    kmerdeque_array_t* a = __atomic_load_n(&Q->a, __ATOMIC_ACQUIRE);
+    *x = kmerdeque_array_get(a, t);
+    return __atomic_compare_exchange_n(&Q->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+
+/* True if there may be something to steal from Q. */
+static bool kmerdeque_nonempty(const kmerdeque_t* Q)
+{
+    return __atomic_load_n(&Q->top, __ATOMIC_ACQUIRE) <
+           __atomic_load_n(&Q->bottom, __ATOMIC_ACQUIRE);
+}
+
+
 /* An edge used for dbg_dump. */
 typedef struct edge_t_
 {
@@ -96,6 +207,13 @@ static edgestack_t* edgestack_alloc()
 }
 
 
+static void edgestack_free(edgestack_t* S)
+{
+    free(S->es);
+    free(S);
+}
+
+
 static void edgestack_push(edgestack_t* S, const edge_t* e)
 {
     if (S->n == S->size) {
@@ -125,9 +243,69 @@ static bool edgestack_pop(edgestack_t* S, edge_t* e)
 #endif
 
 
+/* A unitig: a maximal path through the graph without branches. */
+typedef struct unitig_t_
+{
+    twobit_t* seq;
+
+    /* Sum of the counts of its k-mers. */
+    uint64_t count;
+
+    /* Its first and last k-mers, oriented as in seq. */
+    kmer_t first, last;
+
+    /* Masks of the nucleotides x such that last, or the reverse complement
+     * of first, followed by x is a neighboring k-mer. */
+    uint8_t next, prev;
+} unitig_t;
+
+
+typedef struct unitigstack_t_
+{
+    unitig_t* us;
+    size_t n;
+    size_t size;
+} unitigstack_t;
+
+
+static unitigstack_t* unitigstack_alloc()
+{
+    unitigstack_t* S = malloc_or_die(sizeof(unitigstack_t));
+    S->n = 0;
+    S->size = 1024;
+    S->us = malloc_or_die(S->size * sizeof(unitig_t));
+    return S;
+}
+
+
+static void unitigstack_free(unitigstack_t* S)
+{
+    size_t i;
+    for (i = 0; i < S->n; ++i) {
+        twobit_free(S->us[i].seq);
+    }
+    free(S->us);
+    free(S);
+}
+
+
+static unitig_t* unitigstack_push(unitigstack_t* S)
+{
+    if (S->n == S->size) {
+        S->size *= 2;
+        S->us = realloc_or_die(S->us, S->size * sizeof(unitig_t));
+    }
+
+    return &S->us[S->n++];
+}
+
+
 /* I'm fixing cells per block. It's not obvious the effect of changing it, so I
- * don't want to expose it as an option. */
-static const size_t cells_per_bucket = 8;
+ * don't want to expose it as an option.
+ *
+ * At 16 four-byte cells, a bucket fills exactly one 64-byte cache line, so
+ * probing a subtable costs one line. */
+static const size_t cells_per_bucket = 16;
 
 /* Maximum number of seeds we might accumulated. */
 static const size_t max_seeds = 250000;
@@ -146,91 +324,843 @@ struct dbg_t_
     /* A leaky hash table of k-mer seeds used as starting points for traversing
      * the graph. */
     kmercache_t* seeds;
+
+    /* Only k-mers whose hashes have (uint32_t) h.hi <= seed_threshold are
+     * added to seeds (see dbg_set_seed_rate). */
+    uint32_t seed_threshold;
+
+    /* If non-NULL, k-mers are only added to B once they've been seen
+     * solid_threshold times, being counted until then in this (see
+     * dbg_set_solid). */
+    bloom_bits_t* solid;
+    unsigned int solid_threshold;
+
+    /* Pruning applied by dbg_dump (see dbg_set_min_count), with min_ratio in
+     * units of 2^-16. */
+    uint32_t min_count;
+    uint32_t min_ratio;
+
+    /* Number of k-mers skipped for containing ambiguous nucleotides. */
+    size_t ambiguous_count;
+
+    /* A file the graph was loaded from, if it was memory mapped. */
+    void* map;
+    size_t map_size;
+
+    /* Otherwise, the loaded filter, if it was read into memory. */
+    void* data;
 };
 
 
-dbg_t* dbg_alloc(size_t n, size_t k)
+/* Allocate a graph with every field but the filter and seeds set to its
+ * default, for dbg_alloc and dbg_load to fill in. */
+static dbg_t* dbg_alloc_empty(size_t k)
 {
     dbg_t* G = malloc_or_die(sizeof(dbg_t));
-
-    size_t num_buckets = n / 4 / cells_per_bucket; /* assuming 4 subtables. */
-    G->B = bloom_alloc(num_buckets , cells_per_bucket);
+    G->B = NULL;
     G->k = k;
     G->mask = kmer_mask(k);
+    G->seeds = NULL;
+    G->seed_threshold = UINT32_MAX;
+    G->solid = NULL;
+    G->solid_threshold = 1;
+    G->min_count = 1;
+    G->min_ratio = 0;
+    G->ambiguous_count = 0;
+    G->map = NULL;
+    G->map_size = 0;
+    G->data = NULL;
+    return G;
+}
+
+
+dbg_t* dbg_alloc(size_t n, size_t k, unsigned int counter_bits)
+{
+    dbg_t* G = dbg_alloc_empty(k);
+
+    size_t num_buckets = n / 4 / cells_per_bucket; /* assuming 4 subtables. */
+    G->B = bloom_alloc(num_buckets , cells_per_bucket, counter_bits);
     G->seeds = kmercache_alloc(max_seeds);
     return G;
 }
 
 
-void dbg_free(dbg_t* G)
+void dbg_free(dbg_t* G)
+{
+    bloom_free(G->B);
+    kmercache_free(G->seeds);
+    bloom_bits_free(G->solid);
+#if HAVE_MMAP
+    if (G->map) munmap(G->map, G->map_size);
+#endif
+    free(G->data);
+    free(G);
+}
+
+
+/* Saved graphs begin with this header, followed by the filter's cells at
+ * table_offset, which is page aligned so the table can be mapped in place,
+ * then the seed cache's cells at seeds_offset.
+ *
+ * Everything is stored in the byte order of the machine that saved it. */
+typedef struct dbg_header_t_
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t k;
+    uint64_t num_buckets;
+    uint64_t bucket_size;
+    uint64_t counter_bits;
+    uint64_t table_offset;
+    uint64_t table_size;
+    uint64_t seeds_offset;
+    uint64_t seeds_n;
+    uint64_t ambiguous_count;
+
+    /* Checksum of the table followed by the seeds. */
+    uint64_t data_crc;
+
+    /* Checksum of everything above. */
+    uint64_t header_crc;
+} dbg_header_t;
+
+
+static const char     dbg_magic[8]     = {'P', 'I', 'Q', 'U', 'E', 'D', 'B', 'G'};
+static const uint32_t dbg_version      = 3;
+static const uint64_t dbg_table_align  = 4096;
+
+
+static uint64_t dbg_header_crc(const dbg_header_t* h)
+{
+    return crc64_update((uint8_t*) h, offsetof(dbg_header_t, header_crc), 0);
+}
+
+
+static void fwrite_or_die(const void* ptr, size_t size, FILE* f,
+                          const char* path)
+{
+    if (size > 0 && fwrite(ptr, size, 1, f) != 1) {
+        fprintf(stderr, "Error writing to %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void dbg_save(const dbg_t* G, const char* path)
+{
+    dbg_header_t h;
+    memset(&h, 0, sizeof(dbg_header_t));
+
+    size_t table_size;
+    const void* table = bloom_data(G->B, &table_size);
+    size_t seeds_size = G->seeds->n * sizeof(kmercache_cell_t);
+
+    memcpy(h.magic, dbg_magic, sizeof(dbg_magic));
+    h.version         = dbg_version;
+    h.k               = G->k;
+    h.num_buckets     = bloom_num_buckets(G->B);
+    h.bucket_size     = bloom_bucket_size(G->B);
+    h.counter_bits    = bloom_counter_bits(G->B);
+    h.table_offset    = dbg_table_align;
+    h.table_size      = table_size;
+    h.seeds_offset    = h.table_offset + table_size;
+    h.seeds_n         = G->seeds->n;
+    h.ambiguous_count = G->ambiguous_count;
+    h.data_crc = crc64_update((uint8_t*) table, table_size, 0);
+    h.data_crc = crc64_update((uint8_t*) G->seeds->xs, seeds_size, h.data_crc);
+    h.header_crc = dbg_header_crc(&h);
+
+    FILE* f = fopen_or_die(path, "wb");
+
+    char* pad = malloc_or_die(dbg_table_align);
+    memset(pad, 0, dbg_table_align);
+    fwrite_or_die(&h, sizeof(dbg_header_t), f, path);
+    fwrite_or_die(pad, dbg_table_align - sizeof(dbg_header_t), f, path);
+    free(pad);
+
+    fwrite_or_die(table, table_size, f, path);
+    fwrite_or_die(G->seeds->xs, seeds_size, f, path);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error writing to %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void dbg_load_error(const char* path, const char* msg)
+{
+    fprintf(stderr, "Can not load graph from %s: %s\n", path, msg);
+    exit(EXIT_FAILURE);
+}
+
+
+dbg_t* dbg_load(const char* path, bool verify)
+{
+    FILE* f = fopen_or_die(path, "rb");
+
+    dbg_header_t h;
+    if (fread(&h, sizeof(dbg_header_t), 1, f) != 1) {
+        dbg_load_error(path, "truncated file.");
+    }
+
+    if (memcmp(h.magic, dbg_magic, sizeof(dbg_magic)) != 0) {
+        dbg_load_error(path, "not a saved pique graph.");
+    }
+
+    if (h.version != dbg_version) {
+        dbg_load_error(path, "unsupported version.");
+    }
+
+    if (h.header_crc != dbg_header_crc(&h)) {
+        dbg_load_error(path, "corrupt header.");
+    }
+
+    /* The checksum only catches accidents, so the fields must also describe
+     * a graph the rest of the header and file can hold, assuming 4
+     * subtables. Products are bounded first so that none can overflow. */
+    if (h.k < 1 || h.k > 32 ||
+        h.bucket_size < 1 || h.bucket_size > 32 ||
+        h.num_buckets > UINT64_MAX / (4 * 32 * sizeof(uint32_t)) ||
+        h.table_size != 4 * h.num_buckets * h.bucket_size * sizeof(uint32_t) ||
+        h.table_offset < sizeof(dbg_header_t) ||
+        h.table_offset > h.seeds_offset ||
+        h.table_size > h.seeds_offset - h.table_offset ||
+        h.seeds_n > (UINT64_MAX - h.seeds_offset) / sizeof(kmercache_cell_t)) {
+        dbg_load_error(path, "inconsistent header.");
+    }
+
+    size_t seeds_size = h.seeds_n * sizeof(kmercache_cell_t);
+    size_t file_size = h.seeds_offset + seeds_size;
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (size_t) st.st_size < file_size) {
+        dbg_load_error(path, "truncated file.");
+    }
+
+    dbg_t* G = dbg_alloc_empty(h.k);
+    G->ambiguous_count = h.ambiguous_count;
+
+    char* data = NULL;
+
+#if HAVE_MMAP
+    /* Mapped privately, so the graph can still be added to without changing
+     * the file. */
+    data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fileno(f), 0);
+    if (data == MAP_FAILED) data = NULL;
+    else {
+        G->map = data;
+        G->map_size = file_size;
+    }
+#endif
+
+    if (data == NULL) {
+        G->data = data = aligned_malloc_or_die(dbg_table_align, file_size);
+        rewind(f);
+        if (fread(data, 1, file_size, f) != file_size) {
+            dbg_load_error(path, "truncated file.");
+        }
+    }
+    fclose(f);
+
+    if (verify) {
+        uint64_t crc = crc64_update((uint8_t*) data + h.table_offset,
+                                    h.table_size, 0);
+        crc = crc64_update((uint8_t*) data + h.seeds_offset, seeds_size, crc);
+        if (crc != h.data_crc) dbg_load_error(path, "checksum mismatch.");
+    }
+
+    G->B = bloom_alloc_data(data + h.table_offset, h.num_buckets,
+                            h.bucket_size, h.counter_bits);
+    G->seeds = kmercache_alloc(h.seeds_n);
+    memcpy(G->seeds->xs, data + h.seeds_offset, seeds_size);
+
+    /* Traversal starts from the seeds, so one too long for k would be read
+     * past the ends of the tables indexed by its nucleotides. */
+    size_t i;
+    for (i = 0; i < G->seeds->n; ++i) {
+        if (G->seeds->xs[i].x & ~G->mask) {
+            dbg_load_error(path, "seed longer than k.");
+        }
+    }
+
+    return G;
+}
+
+
+/* Number of k-mers gathered before being handed to bloom_add_batch. */
+#define KMER_BATCH_SIZE 256
+
+
+/* K-mers are buffered for partitioned ingest by groups of this many filter
+ * slices at most. A large filter has tens of thousands of slices, and
+ * scattering k-mers between that many buffers while reading would thrash the
+ * TLB instead, so they're sorted by slice within a group as it's drained. */
+static const size_t max_slice_groups = 1024;
+
+
+/* K-mers buffered for partitioned ingest, by the group of filter slices they
+ * fall in. Only their hashes are kept, since that's all the filter needs. */
+struct dbg_partitions_t_
+{
+    /* Slice s falls in group s >> shift. */
+    size_t num_groups;
+    unsigned int shift;
+
+    kmer_hash128_t** hs;
+    size_t* n;
+    size_t* size;
+
+    /* Total number of k-mers buffered. */
+    size_t total;
+};
+
+
+dbg_partitions_t* dbg_partitions_alloc(const dbg_t* G)
+{
+    dbg_partitions_t* P = malloc_or_die(sizeof(dbg_partitions_t));
+    size_t num_slices = bloom_num_slices(G->B);
+    P->shift = 0;
+    while ((num_slices >> P->shift) > max_slice_groups) ++P->shift;
+    P->num_groups = num_slices >> P->shift;
+
+    P->hs = malloc_or_die(P->num_groups * sizeof(kmer_hash128_t*));
+    P->n = malloc_or_die(P->num_groups * sizeof(size_t));
+    P->size = malloc_or_die(P->num_groups * sizeof(size_t));
+
+    size_t i;
+    for (i = 0; i < P->num_groups; ++i) {
+        P->hs[i] = NULL;
+        P->n[i] = P->size[i] = 0;
+    }
+    P->total = 0;
+
+    return P;
+}
+
+
+void dbg_partitions_free(dbg_partitions_t* P)
+{
+    if (P == NULL) return;
+    size_t i;
+    for (i = 0; i < P->num_groups; ++i) {
+        free(P->hs[i]);
+    }
+    free(P->hs);
+    free(P->n);
+    free(P->size);
+    free(P);
+}
+
+
+size_t dbg_partitions_size(const dbg_partitions_t* P)
+{
+    return P->total;
+}
+
+
+static void dbg_partitions_push(dbg_partitions_t* P, size_t slice,
+                                kmer_hash128_t h)
+{
+    size_t g = slice >> P->shift;
+    if (P->n[g] == P->size[g]) {
+        P->size[g] = P->size[g] == 0 ? 1024 : 2 * P->size[g];
+        P->hs[g] = realloc_or_die(P->hs[g],
+                                  P->size[g] * sizeof(kmer_hash128_t));
+    }
+
+    P->hs[g][P->n[g]++] = h;
+    ++P->total;
+}
+
+
+/* Add a batch of at most KMER_BATCH_SIZE canonical k-mers to the graph, or, if
+ * P is non-NULL, add them to the seed cache but only buffer them in P for the
+ * filter. */
+static void dbg_add_kmers(dbg_t* G, dbg_partitions_t* P, rng_t* rng,
+                          const kmer_t* xs, size_t n)
+{
+    /* Each k-mer is hashed once, for both the filter and the seed cache. */
+    kmer_hash128_t hs[KMER_BATCH_SIZE];
+    kmer_t solid_xs[KMER_BATCH_SIZE];
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        hs[i] = kmer_hash128(xs[i]);
+    }
+
+    /* Drop k-mers not yet seen solid_threshold times. */
+    if (G->solid) {
+        unsigned int counts[KMER_BATCH_SIZE];
+        bloom_bits_inc_batch(G->solid, hs, n, counts);
+
+        size_t m = 0;
+        for (i = 0; i < n; ++i) {
+            if (counts[i] >= G->solid_threshold) {
+                hs[m] = hs[i];
+                solid_xs[m] = xs[i];
+                ++m;
+            }
+        }
+        xs = solid_xs;
+        n = m;
+    }
+
+    if (P) {
+        for (i = 0; i < n; ++i) {
+            dbg_partitions_push(P, bloom_slice(G->B, hs[i]), hs[i]);
+        }
+    }
+    else bloom_add_batch(G->B, hs, n, G->solid_threshold);
+
+    for (i = 0; i < n; ++i) {
+        if ((uint32_t) hs[i].hi <= G->seed_threshold) {
+            kmercache_inc(G->seeds, rng, xs[i], hs[i]);
+        }
+    }
+}
+
+
+void dbg_set_seed_rate(dbg_t* G, uint32_t s)
+{
+    G->seed_threshold = s <= 1 ? UINT32_MAX : UINT32_MAX / s;
+}
+
+
+void dbg_set_min_count(dbg_t* G, uint32_t min_count, double min_ratio)
+{
+    G->min_count = min_count > 1 ? min_count : 1;
+
+    if (min_ratio <= 0.0)      G->min_ratio = 0;
+    else if (min_ratio >= 1.0) G->min_ratio = 1 << 16;
+    else                       G->min_ratio = (uint32_t) (min_ratio * (1 << 16));
+}
+
+
+/* Bits per k-mer given to each level of the solid k-mer filter. */
+static const size_t solid_bits_per_kmer = 8;
+
+
+void dbg_set_solid(dbg_t* G, unsigned int threshold, size_t n)
+{
+    bloom_bits_free(G->solid);
+    G->solid = NULL;
+    G->solid_threshold = 1;
+
+    /* By default, four times as many k-mers as the graph has cells, assuming
+     * 4 subtables. */
+    if (n == 0) n = 4 * 4 * bloom_num_buckets(G->B) * bloom_bucket_size(G->B);
+
+    if (threshold > 1) {
+        G->solid = bloom_bits_alloc(n * solid_bits_per_kmer / 64, threshold - 1);
+        G->solid_threshold = threshold;
+    }
+}
+
+
+/* Rolling canonical k-mer extraction.
+ *
+ * The k-mer x and its reverse complement xr are both updated incrementally as
+ * each nucleotide c is shifted in, so there is no need to reverse complement
+ * the whole k-mer at every position. */
+typedef struct kmer_roll_t_
+{
+    kmer_t x, xr;
+    kmer_t mask;
+    size_t shift;
+} kmer_roll_t;
+
+
+static void kmer_roll_init(kmer_roll_t* r, size_t k)
+{
+    r->x = r->xr = 0;
+    r->mask = kmer_mask(k);
+    r->shift = 2 * (k - 1);
+}
+
+
+/* Shift in nucleotide c and return the canonical k-mer. */
+static kmer_t kmer_roll_push(kmer_roll_t* r, kmer_t c)
+{
+    r->x  = ((r->x << 2) | c) & r->mask;
+    r->xr = (r->xr >> 2) | ((3 - c) << r->shift);
+    return r->x < r->xr ? r->x : r->xr;
+}
+
+
+void dbg_add_twobit_seq(dbg_t* G, rng_t* rng, const twobit_t* seq)
+{
+    kmer_t ys[KMER_BATCH_SIZE];
+    size_t n = 0;
+
+    kmer_roll_t r;
+    kmer_roll_init(&r, G->k);
+
+    size_t i, len = twobit_len(seq);
+    kmer_t y;
+    for (i = 0; i < len; ++i) {
+        y = kmer_roll_push(&r, twobit_get(seq, i));
+
+        if (i + 1 >= G->k) {
+            ys[n++] = y;
+            if (n == KMER_BATCH_SIZE) {
+                dbg_add_kmers(G, NULL, rng, ys, n);
+                n = 0;
+            }
+        }
+    }
+
+    dbg_add_kmers(G, NULL, rng, ys, n);
+}
+
+
+/* dbg_add_seq and dbg_partition_seq, which differ only in P being NULL. */
+static void dbg_add_seq_(dbg_t* G, dbg_partitions_t* P, rng_t* rng,
+                         const char* seq, size_t len)
+{
+    kmer_t ys[KMER_BATCH_SIZE];
+    size_t n = 0;
+
+    kmer_roll_t r;
+    kmer_roll_init(&r, G->k);
+
+    /* Nucleotides read since the last ambiguous one. An ambiguous nucleotide
+     * restarts the window, rather than being read as an A, so no k-mer
+     * spanning it is added. */
+    size_t run = 0;
+    size_t num_kmers = 0;
+
+    /* The sequence is packed 32 nucleotides at a time, the last few padded
+     * out with Ns, along with a mask of the ambiguous ones. */
+    char pad[32];
+    uint32_t ambig;
+    size_t i, j, m;
+    kmer_t x, y;
+    for (i = 0; i < len; i += 32) {
+        if (len - i >= 32) {
+            m = 32;
+            ambig = twobit_encode32(seq + i, &x);
+        }
+        else {
+            m = len - i;
+            memset(pad, 'N', sizeof(pad));
+            memcpy(pad, seq + i, m);
+            ambig = twobit_encode32(pad, &x);
+        }
+
+        for (j = 0; j < m; ++j, x >>= 2, ambig >>= 1) {
+            if (ambig & 1) {
+                run = 0;
+                continue;
+            }
+
+            y = kmer_roll_push(&r, x & 0x3);
+
+            if (++run >= G->k) {
+                ys[n++] = y;
+                ++num_kmers;
+                if (n == KMER_BATCH_SIZE) {
+                    dbg_add_kmers(G, P, rng, ys, n);
+                    n = 0;
+                }
+            }
+        }
+    }
+
+    dbg_add_kmers(G, P, rng, ys, n);
+
+    if (len >= G->k && num_kmers < len - G->k + 1) {
+        __atomic_fetch_add(&G->ambiguous_count, len - G->k + 1 - num_kmers,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+
+void dbg_add_seq(dbg_t* G, rng_t* rng, const char* seq, size_t len)
+{
+    dbg_add_seq_(G, NULL, rng, seq, len);
+}
+
+
+void dbg_partition_seq(dbg_t* G, dbg_partitions_t* P, rng_t* rng,
+                       const char* seq, size_t len)
+{
+    dbg_add_seq_(G, P, rng, seq, len);
+}
+
+
+/* Insert buffered k-mers a slice at a time. No other thread touches the
+ * slice meanwhile, and it's small enough to stay largely in cache. */
+void dbg_add_partitions(dbg_t* G, dbg_partitions_t* const* Ps, size_t n,
+                        size_t* next_group)
+{
+    const bloom_t* B = G->B;
+    size_t num_groups = Ps[0]->num_groups;
+    unsigned int shift = Ps[0]->shift;
+    size_t slices_per_group = (size_t) 1 << shift;
+
+    /* K-mers of a group, counting sorted by slice. */
+    kmer_hash128_t* hs = NULL;
+    size_t size = 0;
+    size_t* offsets = malloc_or_die((slices_per_group + 1) * sizeof(size_t));
+
+    size_t i, j, m, g;
+    dbg_partitions_t* P;
+    while (true) {
+        g = __atomic_fetch_add(next_group, 1, __ATOMIC_RELAXED);
+        if (g >= num_groups) break;
+
+        /* A group of one slice needs no sorting. */
+        if (shift == 0) {
+            for (i = 0; i < n; ++i) {
+                P = Ps[i];
+                bloom_add_batch(G->B, P->hs[g], P->n[g], G->solid_threshold);
+                __atomic_fetch_sub(&P->total, P->n[g], __ATOMIC_RELAXED);
+                P->n[g] = 0;
+            }
+            continue;
+        }
+
+        memset(offsets, 0, (slices_per_group + 1) * sizeof(size_t));
+        m = 0;
+        for (i = 0; i < n; ++i) {
+            P = Ps[i];
+            for (j = 0; j < P->n[g]; ++j) {
+                ++offsets[(bloom_slice(B, P->hs[g][j]) &
+                           (slices_per_group - 1)) + 1];
+            }
+            m += P->n[g];
+        }
+
+        for (j = 1; j <= slices_per_group; ++j) {
+            offsets[j] += offsets[j - 1];
+        }
+
+        if (m > size) {
+            size = m;
+            free(hs);
+            hs = malloc_or_die(size * sizeof(kmer_hash128_t));
+        }
+
+        for (i = 0; i < n; ++i) {
+            P = Ps[i];
+            for (j = 0; j < P->n[g]; ++j) {
+                hs[offsets[bloom_slice(B, P->hs[g][j]) &
+                           (slices_per_group - 1)]++] = P->hs[g][j];
+            }
+            __atomic_fetch_sub(&P->total, P->n[g], __ATOMIC_RELAXED);
+            P->n[g] = 0;
+        }
+
+        bloom_add_batch(G->B, hs, m, G->solid_threshold);
+    }
+
+    free(offsets);
+    free(hs);
+}
+
+
+size_t dbg_ambiguous_count(const dbg_t* G)
+{
+    return G->ambiguous_count;
+}
+
+
+static int kmer_cache_cell_cmp(const void* a, const void* b)
+{
+    uint32_t ca = ((kmercache_cell_t*) a)->count;
+    uint32_t cb = ((kmercache_cell_t*) b)->count;
+
+    if      (ca  < cb) return -1;
+    else if (ca == cb) return  0;
+    else               return  1;
+}
+
+
+/* State shared by threads traversing the graph. */
+typedef struct dbg_dump_ctx_t_
+{
+    const bloom_t* B;
+    size_t k;
+
+    /* Nodes claimed so far. */
+    bloom_visited_t* V;
+
+    /* When merging, a second graph's filter, traversed along with B as though
+     * the two were one graph with their counts summed (see dbg_dump_get), and
+     * nodes claimed in it. Otherwise NULL. */
+    const bloom_t* B2;
+    bloom_visited_t* V2;
+
+    /* If non-NULL, nodes are added to this filter, with their counts, rather
+     * than edges being collected. */
+    bloom_t* dest;
+
+    /* K-mers with lower counts than this, or than min_ratio (in units of
+     * 2^-16) times the largest count on their side of a junction (see
+     * junction_t), are pruned there. */
+    uint32_t min_count;
+    uint32_t min_ratio;
+
+    /* One deque for each thread. */
+    kmerdeque_t** deques;
+    size_t num_threads;
+
+    /* Number of threads that are not out of work. */
+    size_t active;
+} dbg_dump_ctx_t;
+
+
+/* Look up the count of the canonical k-mer x, also outputting whether it has
+ * been claimed. A k-mer present in B is claimed there, and otherwise in B2. */
+static uint32_t dbg_dump_get(const dbg_dump_ctx_t* ctx, kmer_t x,
+                             bool* claimed)
+{
+    uint32_t count = bloom_get_claimed(ctx->B, ctx->V, x, claimed);
+    if (ctx->B2) {
+        bool claimed2;
+        uint32_t count2 = bloom_get_claimed(ctx->B2, ctx->V2, x, &claimed2);
+        if (count == 0) *claimed = claimed2;
+        count += count2;
+    }
+
+    return count;
+}
+
+
+/* Claim the canonical k-mer x, as bloom_claim, returning its count if this
+ * call claimed it, or else 0. */
+static uint32_t dbg_dump_claim(const dbg_dump_ctx_t* ctx, kmer_t x)
+{
+    if (ctx->B2 == NULL) return bloom_claim(ctx->B, ctx->V, x);
+
+    uint32_t count2 = bloom_get(ctx->B2, x);
+    if (bloom_get(ctx->B, x) > 0) {
+        uint32_t count = bloom_claim(ctx->B, ctx->V, x);
+        return count > 0 ? count + count2 : 0;
+    }
+    else if (count2 > 0) return bloom_claim(ctx->B2, ctx->V2, x);
+    else                 return 0;
+}
+
+
+/* One thread traversing the graph. */
+typedef struct dbg_dump_thread_ctx_t_
+{
+    dbg_dump_ctx_t* shared;
+    size_t id;
+} dbg_dump_thread_ctx_t;
+
+
+/* The k-mers either side of the junction following the oriented k-mer u,
+ * i.e. its last k - 1 nucleotides: on the left, u and the k-mers differing
+ * from it only in their first nucleotide, and on the right, u's successors.
+ *
+ * Every kept k-mer on the left has an edge to every kept k-mer on the right.
+ * Pruning (see dbg_dump_ctx_t) compares k-mers on the same side of a junction,
+ * so an edge is kept or not whichever of its ends it's seen from. */
+typedef struct junction_t_
 {
-    bloom_free(G->B);
-    kmercache_free(G->seeds);
-    free(G);
-}
+    /* Canonical right k-mers, by their last nucleotide, with their counts and
+     * whether they have been claimed. */
+    kmer_t right[4];
+    uint32_t right_counts[4];
+    bool right_claimed[4];
 
+    /* The kept k-mers on each side, with bit x set for the k-mer with first
+     * (left) or last (right) nucleotide x. */
+    uint32_t left_mask;
+    uint32_t right_mask;
+} junction_t;
 
-void dbg_add_twobit_seq(dbg_t* G, rng_t* rng, const twobit_t* seq)
-{
-    size_t i, len = twobit_len(seq);
-    kmer_t x = 0, y;
-    for (i = 0; i < len; ++i) {
-        x = ((x << 2) | twobit_get(seq, i)) & G->mask;
 
-        if (i + 1 >= G->k) {
-            y = kmer_canonical(x, G->k);
-            bloom_add(G->B, y, 1);
-            kmercache_inc(G->seeds, rng, y);
-        }
+static uint32_t junction_threshold(const dbg_dump_ctx_t* ctx,
+                                   const uint32_t counts[4])
+{
+    uint32_t max_count = 0;
+    size_t x;
+    for (x = 0; x < 4; ++x) {
+        if (counts[x] > max_count) max_count = counts[x];
     }
+
+    uint32_t t = ((uint64_t) ctx->min_ratio * max_count + 0xffff) >> 16;
+    return t > ctx->min_count ? t : ctx->min_count;
 }
 
 
-static int kmer_cache_cell_cmp(const void* a, const void* b)
+/* Find the junction following u, which has count u_count.
+ *
+ * Unless need_left is true, the left side is only looked up if needed to
+ * prune, and otherwise only u's bit of left_mask is meaningful. */
+static void dbg_junction(const dbg_dump_ctx_t* ctx, kmer_t u, uint32_t u_count,
+                         bool need_left, junction_t* J)
 {
-    uint32_t ca = ((kmercache_cell_t*) a)->count;
-    uint32_t cb = ((kmercache_cell_t*) b)->count;
+    size_t k = ctx->k;
+    kmer_t mask = kmer_mask(k);
+    kmer_t x;
+    for (x = 0; x < 4; ++x) {
+        J->right[x] = kmer_canonical(((u << 2) | x) & mask, k);
+        J->right_counts[x] = dbg_dump_get(ctx, J->right[x],
+                                          &J->right_claimed[x]);
+    }
 
-    if      (ca  < cb) return -1;
-    else if (ca == cb) return  0;
-    else               return  1;
-}
+    uint32_t t = junction_threshold(ctx, J->right_counts);
+    J->right_mask = 0;
+    for (x = 0; x < 4; ++x) {
+        if (J->right_counts[x] >= t) J->right_mask |= 1 << x;
+    }
 
+    kmer_t u_first = u >> (2 * (k - 1));
+    uint32_t left_counts[4] = {0, 0, 0, 0};
+    bool claimed;
+    left_counts[u_first] = u_count;
+    if (need_left || ctx->min_ratio > 0) {
+        for (x = 0; x < 4; ++x) {
+            if (x == u_first) continue;
+            left_counts[x] = dbg_dump_get(ctx, kmer_canonical(
+                        (u & (mask >> 2)) | (x << (2 * (k - 1))), k), &claimed);
+        }
+    }
 
-/* One thread traversing the graph. */
-typedef struct dbg_dump_thread_ctx_t_
-{
-    bloom_t* B;
-    kmerstack_t* seeds;
-    size_t k;
-} dbg_dump_thread_ctx_t;
+    t = junction_threshold(ctx, left_counts);
+    J->left_mask = 0;
+    for (x = 0; x < 4; ++x) {
+        if (left_counts[x] >= t) J->left_mask |= 1 << x;
+    }
+}
 
 
 /* A helper function used by dbg_dump_thread.
  *
- * Find all out-edges from the given k-mer, push to edges, and push discovered
- * nodes to S.
+ * Find all out-edges from the given k-mer, push to edges (unless it is NULL),
+ * and push discovered nodes to Q. Pruned k-mers are treated as absent, so are
+ * neither output nor traversed.
+ *
+ * Every edge is seen from both its ends, but is only output from the end with
+ * the smaller canonical k-mer, given here as self. Self-loops are output only
+ * as out-edges.
  * */
-static void enumerate_out_edges(kmer_t u, size_t k,
-                                bloom_t* B,
-                                kmerstack_t* S,
-                                edgestack_t* edges)
+static void enumerate_out_edges(const dbg_dump_ctx_t* ctx, kmer_t u,
+                                kmer_t self, uint32_t u_count,
+                                kmerdeque_t* Q, edgestack_t* edges)
 {
-    kmer_t mask = kmer_mask(k);
-    uint32_t count;
+    size_t k = ctx->k;
+    junction_t J;
+    dbg_junction(ctx, u, u_count, false, &J);
+    if (!(J.left_mask & (1 << (u >> (2 * (k - 1)))))) return;
+
     edge_t e;
     e.u = u;
-    kmer_t v, vc, x;
+    kmer_t x;
     for (x = 0; x < 4; ++x) {
-        v = ((u << 2) | x) & mask;
-        vc = kmer_canonical(v, k);
-        count = bloom_get(B, vc);
-        if (count > 0) {
-            e.v = v;
-            e.count = count;
+        if (!(J.right_mask & (1 << x))) continue;
+
+        if (edges && self <= J.right[x]) {
+            e.v = ((u << 2) | x) & kmer_mask(k);
+            e.count = J.right_counts[x];
             edgestack_push(edges, &e);
-            kmerstack_push(S, vc);
         }
+        if (!J.right_claimed[x]) kmerdeque_push(Q, J.right[x]);
     }
 }
 
@@ -238,73 +1168,300 @@ static void enumerate_out_edges(kmer_t u, size_t k,
 /* A helper function used by dbg_dump_thread.
  *
  * Find all in-edges from the given k-mer, push to edges, and push discovered
- * nodes to S.
+ * nodes to Q, as in enumerate_out_edges.
  * */
-static void enumerate_in_edges(kmer_t v, size_t k, uint32_t v_count,
-                               bloom_t* B, kmerstack_t* S, edgestack_t* edges)
+static void enumerate_in_edges(const dbg_dump_ctx_t* ctx, kmer_t v,
+                               kmer_t self, uint32_t v_count,
+                               kmerdeque_t* Q, edgestack_t* edges)
 {
-    kmer_t mask = kmer_mask(k);
-    uint32_t u_count;
+    /* In-edges of v are out-edges of its reverse complement, reversed. */
+    size_t k = ctx->k;
+    kmer_t v_rc = kmer_revcomp(v, k);
+    junction_t J;
+    dbg_junction(ctx, v_rc, v_count, false, &J);
+    if (!(J.left_mask & (1 << (v_rc >> (2 * (k - 1)))))) return;
+
     edge_t e;
     e.v = v;
     e.count = v_count;
-    kmer_t u, uc, x;
-    for (x = 0; x < 4; ++x) {;
-        u = ((v >> 2) | (x << (2*(k-1)))) & mask;
-        uc = kmer_canonical(u, k);
-        u_count = bloom_get(B, uc);
-        if (u_count > 0) {
-            e.u = u;
+    kmer_t x;
+    for (x = 0; x < 4; ++x) {
+        if (!(J.right_mask & (1 << x))) continue;
+
+        if (edges && self < J.right[x]) {
+            e.u = kmer_revcomp(((v_rc << 2) | x) & kmer_mask(k), k);
             edgestack_push(edges, &e);
-            kmerstack_push(S, uc);
         }
+        if (!J.right_claimed[x]) kmerdeque_push(Q, J.right[x]);
+    }
+}
+
+
+/* Try to steal a k-mer from some other thread's deque. */
+static bool dbg_dump_steal(dbg_dump_ctx_t* ctx, size_t id, kmer_t* u)
+{
+    size_t i, j;
+    for (i = 1; i < ctx->num_threads; ++i) {
+        j = (id + i) % ctx->num_threads;
+        if (kmerdeque_steal(ctx->deques[j], u)) return true;
+    }
+
+    return false;
+}
+
+
+/* Find the next k-mer to expand, from our own deque if possible, or else by
+ * stealing. Returns false once every thread is out of work. */
+static bool dbg_dump_next(dbg_dump_ctx_t* ctx, size_t id, kmer_t* u)
+{
+    if (kmerdeque_pop(ctx->deques[id], u)) return true;
+    if (dbg_dump_steal(ctx, id, u)) return true;
+
+    /* Out of work. Only threads that are still active can produce more, so
+     * we wait for them to either do so or finish. */
+    __atomic_fetch_sub(&ctx->active, 1, __ATOMIC_SEQ_CST);
+    size_t i;
+    while (__atomic_load_n(&ctx->active, __ATOMIC_SEQ_CST) > 0) {
+        for (i = 0; i < ctx->num_threads; ++i) {
+            if (kmerdeque_nonempty(ctx->deques[i])) break;
+        }
+
+        if (i < ctx->num_threads) {
+            __atomic_fetch_add(&ctx->active, 1, __ATOMIC_SEQ_CST);
+            if (dbg_dump_steal(ctx, id, u)) return true;
+            __atomic_fetch_sub(&ctx->active, 1, __ATOMIC_SEQ_CST);
+        }
+
+        sched_yield();
     }
+
+    return false;
 }
 
 
 /* A de bruijn graph traversal thread.
  *
- * Eeach thread starts from a seed and performs (essentially) depth-first
- * traversal, deleting nodes as it goes and pushing edges onto a stack. */
+ * Eeach thread starts from its share of the seeds and performs (essentially)
+ * depth-first traversal, pushing edges onto a stack. Nodes are claimed before
+ * being expanded, so each is expanded by exactly one thread, exactly once.
+ * Threads that run out of work steal unexpanded nodes from the others.
+ */
 static void* dbg_dump_thread(void* arg)
 {
-    dbg_dump_thread_ctx_t* ctx = (dbg_dump_thread_ctx_t*) arg;
-    edgestack_t* edges = edgestack_alloc();
-    kmerstack_t* S = kmerstack_alloc();
+    dbg_dump_thread_ctx_t* thread_ctx = (dbg_dump_thread_ctx_t*) arg;
+    dbg_dump_ctx_t* ctx = thread_ctx->shared;
+    kmerdeque_t* Q = ctx->deques[thread_ctx->id];
+    edgestack_t* edges = ctx->dest ? NULL : edgestack_alloc();
 
     uint32_t u_count;
     kmer_t u, u_rc;
-    while (kmerstack_pop(ctx->seeds, &u)) {
-        u = kmer_canonical(u, ctx->k);
-        do {
-            u_count = bloom_get(ctx->B, u);
-            if (u_count == 0) continue;
+    while (dbg_dump_next(ctx, thread_ctx->id, &u)) {
+        u_count = dbg_dump_claim(ctx, u);
+        if (u_count == 0 || u_count < ctx->min_count) continue;
 
-            u_rc = kmer_revcomp(u, ctx->k);
+        if (ctx->dest) bloom_add(ctx->dest, u, u_count);
 
-            /* TODO: It's possible here to push the same edge twice.
-             * Is this ever a problem? */
+        u_rc = kmer_revcomp(u, ctx->k);
 
-            enumerate_out_edges(u, ctx->k, ctx->B, S, edges);
-            enumerate_out_edges(u_rc, ctx->k, ctx->B, S, edges);
+        enumerate_out_edges(ctx, u, u, u_count, Q, edges);
+        enumerate_in_edges(ctx, u, u, u_count, Q, edges);
 
-            enumerate_in_edges(u, ctx->k, u_count, ctx->B, S, edges);
-            enumerate_in_edges(u_rc, ctx->k, u_count, ctx->B, S, edges);
-
-            bloom_del(ctx->B, u);
-        } while (kmerstack_pop(S, &u));
+        /* A palindrome is its own reverse complement. */
+        if (u_rc != u) {
+            enumerate_out_edges(ctx, u_rc, u, u_count, Q, edges);
+            enumerate_in_edges(ctx, u_rc, u, u_count, Q, edges);
+        }
     }
 
-    kmerstack_free(S);
     return edges;
 }
 
 
-/* Write a sparse adjacency matrix in matrix market exchange format. */
+/* The path followed while finding a unitig. */
+typedef struct unitig_walk_t_
+{
+    /* Canonical k-mers visited. */
+    kmer_t* xs;
+    size_t n, size;
+
+    /* The smallest of them. */
+    kmer_t owner;
+
+    /* Sum of their counts. */
+    uint64_t count;
+} unitig_walk_t;
+
+
+static void unitig_walk_push(unitig_walk_t* W, kmer_t x, uint32_t count)
+{
+    if (W->n == W->size) {
+        W->size *= 2;
+        W->xs = realloc_or_die(W->xs, W->size * sizeof(kmer_t));
+    }
+
+    W->xs[W->n++] = x;
+    if (x < W->owner) W->owner = x;
+    W->count += count;
+}
+
+
+/* Follow the unitig containing the oriented k-mer u, which has count u_count,
+ * as far as it goes past u, adding the k-mers on the way to W and appending
+ * their last nucleotides to seq. The walk ends before a branch, a palindrome,
+ * or a k-mer already in the unitig (reached by going round in a cycle, or
+ * doubling back on the reverse complement).
+ *
+ * Returns:
+ *   The last k-mer, with the nucleotides that can follow it output to next,
+ *   and with cycle set if the walk stopped by coming back to u.
+ */
+static kmer_t dbg_unitig_extend(const dbg_dump_ctx_t* ctx, kmer_t u,
+                                uint32_t u_count, unitig_walk_t* W,
+                                twobit_t* seq, uint8_t* next, bool* cycle)
+{
+    size_t k = ctx->k;
+    kmer_t mask = kmer_mask(k);
+    kmer_t u0 = u, start = kmer_canonical(u, k);
+    kmer_t v, x;
+    junction_t J;
+
+    *cycle = false;
+    if (kmer_revcomp(u, k) == u) {
+        dbg_junction(ctx, u, u_count, false, &J);
+        *next = J.left_mask & (1 << (u >> (2 * (k - 1)))) ? J.right_mask : 0;
+        return u;
+    }
+
+    while (true) {
+        dbg_junction(ctx, u, u_count, true, &J);
+        if (!(J.left_mask & (1 << (u >> (2 * (k - 1)))))) {
+            *next = 0;
+            return u;
+        }
+
+        *next = J.right_mask;
+
+        /* Only one way out of u, and only u leading to it. */
+        if (__builtin_popcount(J.left_mask) != 1 ||
+            __builtin_popcount(J.right_mask) != 1) return u;
+
+        x = __builtin_ctz(J.right_mask);
+        v = ((u << 2) | x) & mask;
+        if (J.right[x] == start) {
+            *cycle = v == u0;
+            return u;
+        }
+        if (kmer_revcomp(v, k) == v || J.right[x] == kmer_canonical(u, k)) {
+            return u;
+        }
+
+        unitig_walk_push(W, J.right[x], J.right_counts[x]);
+        twobit_append_kmer(seq, x, 1);
+        u = v;
+        u_count = J.right_counts[x];
+    }
+}
+
+
+/* A traversal thread finding unitigs, rather than edges, as dbg_dump_thread.
+ *
+ * Any k-mer of a unitig leads to the whole thing, so several threads may find
+ * the same unitig at once. Only the one that claims its smallest k-mer keeps
+ * it, and the rest of its k-mers are then claimed so no one looks again.
+ */
+static void* dbg_unitig_thread(void* arg)
+{
+    dbg_dump_thread_ctx_t* thread_ctx = (dbg_dump_thread_ctx_t*) arg;
+    dbg_dump_ctx_t* ctx = thread_ctx->shared;
+    kmerdeque_t* Q = ctx->deques[thread_ctx->id];
+    unitigstack_t* unitigs = unitigstack_alloc();
+
+    size_t k = ctx->k;
+    kmer_t mask = kmer_mask(k);
+
+    unitig_walk_t W;
+    W.size = 1024;
+    W.xs = malloc_or_die(W.size * sizeof(kmer_t));
+
+    /* The nucleotides walked past u in either direction. */
+    twobit_t* right = twobit_alloc();
+    twobit_t* left = twobit_alloc();
+
+    unitig_t* U;
+    uint32_t u_count;
+    kmer_t u, first, last, x;
+    uint8_t next, prev;
+    bool claimed, cycle;
+    size_t i;
+    while (dbg_dump_next(ctx, thread_ctx->id, &u)) {
+        u_count = dbg_dump_get(ctx, u, &claimed);
+        if (claimed || u_count == 0 || u_count < ctx->min_count) continue;
+
+        W.n = 0;
+        W.owner = u;
+        W.count = 0;
+        unitig_walk_push(&W, u, u_count);
+        twobit_clear(right);
+        twobit_clear(left);
+
+        last = dbg_unitig_extend(ctx, u, u_count, &W, right, &next, &cycle);
+        if (cycle) {
+            first = u;
+            prev = 1 << kmer_comp1(last >> (2 * (k - 1)));
+        }
+        else {
+            first = kmer_revcomp(
+                    dbg_unitig_extend(ctx, kmer_revcomp(u, k), u_count, &W,
+                                      left, &prev, &cycle), k);
+        }
+
+        if (dbg_dump_claim(ctx, W.owner) == 0) continue;
+        for (i = 0; i < W.n; ++i) {
+            dbg_dump_claim(ctx, W.xs[i]);
+        }
+
+        U = unitigstack_push(unitigs);
+        U->seq = twobit_alloc_n(twobit_len(left) + k + twobit_len(right));
+        twobit_revcomp(U->seq, left);
+        /* twobit_append_kmer takes nucleotides from the low bits up, which is
+         * backwards for our k-mers. */
+        for (i = k; i > 0; --i) {
+            twobit_append_kmer(U->seq, u >> (2 * (i - 1)), 1);
+        }
+        twobit_append_twobit(U->seq, right);
+        U->count = W.count;
+        U->first = first;
+        U->last = last;
+        U->next = next;
+        U->prev = prev;
+
+        for (x = 0; x < 4; ++x) {
+            if (next & (1 << x)) {
+                kmerdeque_push(Q, kmer_canonical(((last << 2) | x) & mask, k));
+            }
+            if (prev & (1 << x)) {
+                kmerdeque_push(Q, kmer_canonical(
+                            ((kmer_revcomp(first, k) << 2) | x) & mask, k));
+            }
+        }
+    }
+
+    twobit_free(left);
+    twobit_free(right);
+    free(W.xs);
+
+    return unitigs;
+}
+
+
+/* Write a sparse adjacency matrix in matrix market exchange format.
+ *
+ * The writers are given the matrix indexes of both ends of each edge in idxs,
+ * in the order the edges are stored. */
 static void write_sparse_mm(FILE* fout,
                             size_t node_count,
                             size_t edge_count,
-                            const kmerset_t* H,
+                            const uint32_t* idxs,
                             edgestack_t* const* edges,
                             size_t num_threads)
 {
@@ -313,8 +1470,8 @@ static void write_sparse_mm(FILE* fout,
     unsigned int i, j, u_idx, v_idx;
     for (i = 0; i < num_threads; ++i) {
         for (j = 0; j < edges[i]->n; ++j) {
-            u_idx = kmerset_get(H, edges[i]->es[j].u);
-            v_idx = kmerset_get(H, edges[i]->es[j].v);
+            u_idx = *idxs++;
+            v_idx = *idxs++;
             assert(u_idx > 0);
             assert(v_idx > 0);
             fprintf(fout, "%u %u %"PRIu16"\n",
@@ -349,7 +1506,7 @@ static int edgepair_cmp(const void* a_, const void* b_)
 static void write_sparse_hb(FILE* fout,
                             size_t node_count,
                             size_t edge_count,
-                            const kmerset_t* H,
+                            const uint32_t* idxs,
                             edgestack_t* const* edges,
                             size_t num_threads)
 {
@@ -360,8 +1517,8 @@ static void write_sparse_hb(FILE* fout,
     size_t i, j;
     for (i = 0; i < num_threads; ++i) {
         for (j = 0; j < edges[i]->n; ++j, ++k) {
-            pairs[k].u = kmerset_get(H, edges[i]->es[j].u);
-            pairs[k].v = kmerset_get(H, edges[i]->es[j].v);
+            pairs[k].u = idxs[2 * k];
+            pairs[k].v = idxs[2 * k + 1];
             pairs[k].count = edges[i]->es[j].count;
         }
     }
@@ -403,65 +1560,411 @@ static void write_sparse_hb(FILE* fout,
 }
 
 
-void dbg_dump(const dbg_t* G, FILE* fout, size_t num_threads,
-              adj_graph_fmt_t fmt)
+/* Traverse the graph from its seeds, using the given number of threads,
+ * pruning as given by min_count and min_ratio (see dbg_dump_ctx_t). If H is
+ * non-NULL, the union of G and H is traversed instead, from both their seeds,
+ * with counts summed.
+ *
+ * If dest is non-NULL, every node reached is added to dest. Otherwise, each
+ * thread's edges are output to edges, or, if it's non-NULL, its unitigs to
+ * unitigs. */
+static void dbg_traverse(const dbg_t* G, const dbg_t* H, size_t num_threads,
+                         uint32_t min_count, uint32_t min_ratio,
+                         bloom_t* dest, edgestack_t** edges,
+                         unitigstack_t** unitigs)
 {
     /* Dump seeds and sort for best-first traversal. */
-    kmercache_cell_t* seeds = malloc_or_die(G->seeds->n * sizeof(kmercache_cell_t));
+    size_t num_seeds = G->seeds->n + (H ? H->seeds->n : 0);
+    kmercache_cell_t* seeds = malloc_or_die(num_seeds * sizeof(kmercache_cell_t));
     memcpy(seeds, G->seeds->xs, G->seeds->n * sizeof(kmercache_cell_t));
-    qsort(seeds, G->seeds->n, sizeof(kmercache_cell_t), kmer_cache_cell_cmp);
-
-    /* We make two traversals of the graph. On the first we count the number of
-     * edges and nodes, and on the second we output edges and nodes. */
-
-    kmerstack_t* S = kmerstack_alloc();
+    if (H) {
+        memcpy(seeds + G->seeds->n, H->seeds->xs,
+               H->seeds->n * sizeof(kmercache_cell_t));
+    }
+    qsort(seeds, num_seeds, sizeof(kmercache_cell_t), kmer_cache_cell_cmp);
 
+    /* Deal the seeds out to the threads, so the highest count seeds are
+     * popped first. Seeds are stored in canonical form. */
+    kmerdeque_t** deques = malloc_or_die(num_threads * sizeof(kmerdeque_t*));
     size_t i;
-    for (i = 0; i < G->seeds->n; ++i) {
-        if (seeds[i].count > 0) kmerstack_push(S, seeds[i].x);
+    for (i = 0; i < num_threads; ++i) {
+        deques[i] = kmerdeque_alloc();
+    }
+
+    size_t j = 0;
+    for (i = 0; i < num_seeds; ++i) {
+        if (seeds[i].count > 0) {
+            kmerdeque_push(deques[j++ % num_threads], seeds[i].x);
+        }
     }
 
     pthread_t* threads = malloc_or_die(num_threads * sizeof(pthread_t));
-    edgestack_t** edges = malloc_or_die(num_threads * sizeof(edgestack_t*));
-    dbg_dump_thread_ctx_t ctx;
+    dbg_dump_ctx_t ctx;
     ctx.B = G->B;
-    ctx.seeds = S;
     ctx.k = G->k;
+    ctx.V = bloom_visited_alloc(G->B);
+    ctx.B2 = H ? H->B : NULL;
+    ctx.V2 = H ? bloom_visited_alloc(H->B) : NULL;
+    ctx.dest = dest;
+    ctx.min_count = min_count;
+    ctx.min_ratio = min_ratio;
+    ctx.deques = deques;
+    ctx.num_threads = num_threads;
+    ctx.active = num_threads;
+
+    dbg_dump_thread_ctx_t* thread_ctxs =
+        malloc_or_die(num_threads * sizeof(dbg_dump_thread_ctx_t));
+
+    for (i = 0; i < num_threads; ++i) {
+        thread_ctxs[i].shared = &ctx;
+        thread_ctxs[i].id = i;
+        pthread_create(&threads[i], NULL,
+                       unitigs ? dbg_unitig_thread : dbg_dump_thread,
+                       (void*) &thread_ctxs[i]);
+    }
+
+    void* thread_out;
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], &thread_out);
+        if (unitigs)    unitigs[i] = thread_out;
+        else if (edges) edges[i] = thread_out;
+    }
+
+    free(threads);
+    free(thread_ctxs);
+    bloom_visited_free(ctx.V);
+    bloom_visited_free(ctx.V2);
+    for (i = 0; i < num_threads; ++i) {
+        kmerdeque_free(deques[i]);
+    }
+    free(deques);
+    free(seeds);
+}
+
+
+/* Unitigs, numbered in order, and indexed by their end k-mers so links
+ * between them can be resolved. */
+typedef struct unitig_index_t_
+{
+    size_t k;
+    size_t n;
+    const unitig_t** us;
+
+    /* The unitig with each end k-mer, by its index in H. */
+    kmerset_t* H;
+    uint32_t* end_ids;
+} unitig_index_t;
+
+
+static void unitig_index_init(unitig_index_t* I, size_t k,
+                              unitigstack_t* const* unitigs,
+                              size_t num_threads)
+{
+    size_t i, j;
+    I->k = k;
+    I->n = 0;
+    for (i = 0; i < num_threads; ++i) {
+        I->n += unitigs[i]->n;
+    }
+
+    I->us = malloc_or_die(I->n * sizeof(unitig_t*));
+    I->end_ids = malloc_or_die((2 * I->n + 1) * sizeof(uint32_t));
+    I->H = kmerset_alloc();
+    size_t id = 0;
+    for (i = 0; i < num_threads; ++i) {
+        for (j = 0; j < unitigs[i]->n; ++j, ++id) {
+            I->us[id] = &unitigs[i]->us[j];
+            I->end_ids[kmerset_add(I->H, kmer_canonical(I->us[id]->first, k))] = id;
+            I->end_ids[kmerset_add(I->H, kmer_canonical(I->us[id]->last, k))] = id;
+        }
+    }
+}
+
+
+static void unitig_index_free(unitig_index_t* I)
+{
+    kmerset_free(I->H);
+    free(I->end_ids);
+    free(I->us);
+}
+
+
+/* A link from one unitig to another, which follows it overlapping by k - 1,
+ * either unitig being reverse complemented if its sign is '-'. */
+typedef struct unitig_link_t_
+{
+    char sign;
+    uint32_t to;
+    char to_sign;
+} unitig_link_t;
+
+
+/* Find the links from the given unitig, returning their number, at most 8:
+ * first off its end, then off its start, i.e. the end of its reverse
+ * complement. */
+static size_t unitig_links(const unitig_index_t* I, size_t id,
+                           unitig_link_t links[8])
+{
+    size_t k = I->k;
+    kmer_t mask = kmer_mask(k);
+    const unitig_t* U = I->us[id];
+    kmer_t end, w, x;
+    uint32_t end_idx;
+    size_t n = 0;
+    int side;
+    for (side = 0; side < 2; ++side) {
+        end = side == 0 ? U->last : kmer_revcomp(U->first, k);
+        for (x = 0; x < 4; ++x) {
+            if (!((side == 0 ? U->next : U->prev) & (1 << x))) continue;
+
+            /* Rarely, a unitig is lost when its smallest k-mer shares a
+             * cell, and so a visited bit, with one already claimed. */
+            w = ((end << 2) | x) & mask;
+            end_idx = kmerset_get(I->H, kmer_canonical(w, k));
+            if (end_idx == 0) continue;
+
+            links[n].sign = side == 0 ? '+' : '-';
+            links[n].to = I->end_ids[end_idx];
+            links[n].to_sign = w == I->us[links[n].to]->first ? '+' : '-';
+            ++n;
+        }
+    }
+
+    return n;
+}
+
+
+/* Write one unitig in the given format (see write_unitigs). */
+static void write_unitig(FILE* fout, const unitig_index_t* I, size_t id,
+                         adj_graph_fmt_t fmt)
+{
+    const unitig_t* U = I->us[id];
+    unitig_link_t links[8];
+    size_t n = unitig_links(I, id, links);
+    size_t len = twobit_len(U->seq);
+    size_t i;
+
+    if (fmt == ADJ_GRAPH_FMT_GFA) {
+        fprintf(fout, "S\t%zu\t", id);
+        twobit_print(U->seq, fout);
+        fprintf(fout, "\tLN:i:%zu\tKC:i:%"PRIu64"\n", len, U->count);
+
+        /* Each link is found from both the unitigs it joins, reversed from
+         * one of them, so it's only written from the first. */
+        for (i = 0; i < n; ++i) {
+            if (links[i].to < id ||
+                (links[i].to == id && links[i].sign == '-' &&
+                 links[i].to_sign == '-')) continue;
+
+            fprintf(fout, "L\t%zu\t%c\t%"PRIu32"\t%c\t%zuM\n",
+                    id, links[i].sign, links[i].to, links[i].to_sign,
+                    I->k - 1);
+        }
+    }
+    else {
+        fprintf(fout, ">%zu LN:i:%zu KC:i:%"PRIu64" km:f:%.1f",
+                id, len, U->count, (double) U->count / (len - I->k + 1));
+        for (i = 0; i < n; ++i) {
+            fprintf(fout, " L:%c:%"PRIu32":%c",
+                    links[i].sign, links[i].to, links[i].to_sign);
+        }
+        fputc('\n', fout);
+        twobit_print(U->seq, fout);
+        fputc('\n', fout);
+    }
+}
+
+
+#if HAVE_OPEN_MEMSTREAM
+/* A thread formatting a range of unitigs into its own buffer. */
+typedef struct write_unitigs_ctx_t_
+{
+    const unitig_index_t* I;
+    adj_graph_fmt_t fmt;
+    size_t start, end;
+
+    char* buf;
+    size_t size;
+} write_unitigs_ctx_t;
+
 
+static void* write_unitigs_thread(void* arg)
+{
+    write_unitigs_ctx_t* ctx = arg;
+    FILE* f = open_memstream(&ctx->buf, &ctx->size);
+    if (f == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t id;
+    for (id = ctx->start; id < ctx->end; ++id) {
+        write_unitig(f, ctx->I, id, ctx->fmt);
+    }
+
+    fclose(f);
+    return NULL;
+}
+#endif
+
+
+/* Write unitigs, as either:
+ *
+ * FASTA, one per line, with headers in the style of BCALM 2, e.g.:
+ *
+ *     >0 LN:i:40 KC:i:312 km:f:19.5 L:+:7:- L:-:3:+
+ *
+ * giving the length, total and mean k-mer count, and links to other unitigs.
+ * A link L:a:j:b means unitig j, reverse complemented if b is '-', follows
+ * this one, reverse complemented if a is '-', overlapping by k - 1.
+ *
+ * Or GFA 1.0, with a segment for each unitig, followed by its links.
+ *
+ * Records are formatted in parallel, each thread taking an equal share into
+ * its own buffer, and the buffers then written in order.
+ */
+static void write_unitigs(FILE* fout, size_t k, unitigstack_t* const* unitigs,
+                          size_t num_threads, adj_graph_fmt_t fmt)
+{
+    unitig_index_t I;
+    unitig_index_init(&I, k, unitigs, num_threads);
+
+    if (fmt == ADJ_GRAPH_FMT_GFA) fputs("H\tVN:Z:1.0\n", fout);
+
+#if HAVE_OPEN_MEMSTREAM
+    pthread_t* threads = malloc_or_die(num_threads * sizeof(pthread_t));
+    write_unitigs_ctx_t* ctxs =
+        malloc_or_die(num_threads * sizeof(write_unitigs_ctx_t));
+    size_t i;
     for (i = 0; i < num_threads; ++i) {
-        pthread_create(&threads[i], NULL, dbg_dump_thread, (void*) &ctx);
+        ctxs[i].I = &I;
+        ctxs[i].fmt = fmt;
+        ctxs[i].start = i * I.n / num_threads;
+        ctxs[i].end = (i + 1) * I.n / num_threads;
+        pthread_create(&threads[i], NULL, write_unitigs_thread, &ctxs[i]);
     }
 
     for (i = 0; i < num_threads; ++i) {
-        pthread_join(threads[i], (void**) &edges[i]);
+        pthread_join(threads[i], NULL);
+        fwrite(ctxs[i].buf, 1, ctxs[i].size, fout);
+        free(ctxs[i].buf);
+    }
+
+    free(ctxs);
+    free(threads);
+#else
+    size_t id;
+    for (id = 0; id < I.n; ++id) {
+        write_unitig(fout, &I, id, fmt);
+    }
+#endif
+
+    unitig_index_free(&I);
+}
+
+
+void dbg_dump(const dbg_t* G, FILE* fout, size_t num_threads,
+              adj_graph_fmt_t fmt)
+{
+    size_t i, j;
+
+    if (fmt == ADJ_GRAPH_FMT_UNITIGS || fmt == ADJ_GRAPH_FMT_GFA) {
+        unitigstack_t** unitigs =
+            malloc_or_die(num_threads * sizeof(unitigstack_t*));
+        dbg_traverse(G, NULL, num_threads, G->min_count, G->min_ratio, NULL,
+                     NULL, unitigs);
+
+        write_unitigs(fout, G->k, unitigs, num_threads, fmt);
+
+        for (i = 0; i < num_threads; ++i) {
+            unitigstack_free(unitigs[i]);
+        }
+        free(unitigs);
+        return;
     }
 
-    /* Hash k-mers present in the edge list to assign matrix indexes */
-    size_t j;
+    edgestack_t** edges = malloc_or_die(num_threads * sizeof(edgestack_t*));
+    dbg_traverse(G, NULL, num_threads, G->min_count, G->min_ratio, NULL,
+                 edges, NULL);
+
     size_t edge_count = 0;
+    for (i = 0; i < num_threads; ++i) {
+        edge_count += edges[i]->n;
+    }
+
+    /* Hash k-mers present in the edge list to assign matrix indexes, keeping
+     * them so no k-mer needs to be looked up again. */
+    uint32_t* idxs = malloc_or_die(2 * edge_count * sizeof(uint32_t));
     kmerset_t* H = kmerset_alloc();
+    size_t k = 0;
     for (i = 0; i < num_threads; ++i) {
         for (j = 0; j < edges[i]->n; ++j) {
-            kmerset_add(H, edges[i]->es[j].u);
-            kmerset_add(H, edges[i]->es[j].v);
+            idxs[k++] = kmerset_add(H, edges[i]->es[j].u);
+            idxs[k++] = kmerset_add(H, edges[i]->es[j].v);
         }
-        edge_count += edges[i]->n;
     }
 
     size_t node_count = kmerset_size(H);
+    kmerset_free(H);
 
     if (fmt == ADJ_GRAPH_FMT_HB) {
-        write_sparse_hb(fout, node_count, edge_count, H, edges, num_threads);
+        write_sparse_hb(fout, node_count, edge_count, idxs, edges, num_threads);
     }
     else if (fmt == ADJ_GRAPH_FMT_MM) {
-        write_sparse_mm(fout, node_count, edge_count, H, edges, num_threads);
+        write_sparse_mm(fout, node_count, edge_count, idxs, edges, num_threads);
     }
 
-    kmerset_free(H);
+    free(idxs);
+    for (i = 0; i < num_threads; ++i) {
+        edgestack_free(edges[i]);
+    }
     free(edges);
-    free(threads);
-    kmerstack_free(S);
-    free(seeds);
+}
+
+
+void dbg_merge(dbg_t* G, const dbg_t* H, size_t num_threads)
+{
+    if (G->k != H->k) {
+        fprintf(stderr, "Can not merge graphs with different k-mer sizes.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The union of the graphs is traversed, from both sets of seeds, into a
+     * new filter, so that parts of either reachable only through the other,
+     * or from the other's seeds, aren't lost. The traversal is unpruned, so
+     * the counts of k-mers pruned in one can still add up to something in the
+     * result. */
+    size_t num_buckets = bloom_num_buckets(G->B);
+    if (bloom_num_buckets(H->B) > num_buckets) {
+        num_buckets = bloom_num_buckets(H->B);
+    }
+    bloom_t* B = bloom_alloc(num_buckets, cells_per_bucket,
+                             bloom_counter_bits(G->B));
+    dbg_traverse(G, H, num_threads, 1, 0, B, NULL, NULL);
+
+    bloom_free(G->B);
+    G->B = B;
+#if HAVE_MMAP
+    if (G->map) munmap(G->map, G->map_size);
+#endif
+    free(G->data);
+    G->map = NULL;
+    G->map_size = 0;
+    G->data = NULL;
+
+    /* H's seeds compete for places in G's cache with the counts they have
+     * accumulated. */
+    rng_t* rng = rng_alloc(1234);
+    size_t i;
+    for (i = 0; i < H->seeds->n; ++i) {
+        if (H->seeds->xs[i].count > 0) {
+            kmercache_add(G->seeds, rng, H->seeds->xs[i].x,
+                          H->seeds->xs[i].count);
+        }
+    }
+    rng_free(rng);
+
+    G->ambiguous_count += H->ambiguous_count;
 }
 
 
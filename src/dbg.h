@@ -22,25 +22,156 @@ typedef struct dbg_t_ dbg_t;
  *
  * Args:
  *   n: Reserve space for this many unique k-mers.
+ *   k: K-mer size.
+ *   counter_bits: Bits of each filter cell given to the k-mer's count, rather
+ *                 than its fingerprint (see bloom_alloc).
  *
  * Returns:
  *   An allocated graph.
  */
-dbg_t* dbg_alloc(size_t n, size_t k);
+dbg_t* dbg_alloc(size_t n, size_t k, unsigned int counter_bits);
 
 
-/* Free a graph allocated with dbg_alloc. */
+/* Free a graph allocated with dbg_alloc or dbg_load. */
 void dbg_free(dbg_t* G);
 
 
+/* Save a graph to a file, to be restored with dbg_load. */
+void dbg_save(const dbg_t* G, const char* path);
+
+
+/* Load a graph saved with dbg_save.
+ *
+ * The file is memory mapped, where possible, so the filter is paged in as it
+ * is used rather than read up front.
+ *
+ * Args:
+ *   path: File to load.
+ *   verify: If true, check the whole file against its checksum. This means
+ *           reading all of it.
+ *
+ * Returns:
+ *   The loaded graph. Errors are fatal.
+ */
+dbg_t* dbg_load(const char* path, bool verify);
+
+
+/* Only consider about one in s k-mers as seeds, i.e. starting points for
+ * traversing the graph, rather than all of them (s = 1, the default).
+ *
+ * The sample is chosen by hash, so a k-mer is either always or never
+ * considered, and its count in the seed cache is exact. Sampling spares most
+ * k-mers a second random memory access, but a part of the graph with fewer
+ * than about s k-mers may not be seeded, and is then missing from the output.
+ */
+void dbg_set_seed_rate(dbg_t* G, uint32_t s);
+
+
+/* Keep k-mers out of the graph until they've been seen the given number of
+ * times, counting them until then in a plain bloom filter, sized for about n
+ * distinct k-mers at a byte each per count below the threshold. If n is 0,
+ * four times as many k-mers as the graph has cells are assumed.
+ *
+ * Most k-mers seen only once are sequencing errors, and otherwise each takes a
+ * cell of the graph. Once admitted, a k-mer's count includes the occurrences
+ * seen before. A threshold of 1 admits every k-mer, as by default. This only
+ * applies to k-mers added after the call, and isn't saved with the graph.
+ */
+void dbg_set_solid(dbg_t* G, unsigned int threshold, size_t n);
+
+
+/* Prune k-mers with low counts when dumping the graph: those with counts
+ * below min_count, and, at each (k-1)-mer junction between k-mers, those with
+ * counts below min_ratio times that of an alternative to them there (a k-mer
+ * differing only in the nucleotide not in the junction), which is typical of
+ * errors in high coverage regions. Edges through a junction are kept only
+ * between k-mers kept there. Pruned k-mers are not traversed, so parts of the
+ * graph reachable only through them are dropped too.
+ *
+ * By default, min_count is 1 and min_ratio 0, which prunes nothing. Merging
+ * graphs ignores these, but they apply to the merged graph's dump.
+ */
+void dbg_set_min_count(dbg_t* G, uint32_t min_count, double min_ratio);
+
+
+/* Add the contents of the graph H to G, summing the counts of k-mers in both.
+ *
+ * The union of the graphs is traversed from the seeds of both, with the given
+ * number of threads, and copied into a new filter, the larger of the two
+ * sizes, which replaces G's. So every k-mer that dbg_dump would output from
+ * either graph, or from the two together, is kept, but a third full-size
+ * filter is held alongside G's and H's while merging. The graphs must have
+ * the same k, but need not be the same size.
+ *
+ * H's seeds are added to G's seed cache, which has a fixed size, so some
+ * seeds of either may be evicted. A component whose seeds were all evicted is
+ * still in the filter, but is not reached by a later dbg_dump or merge.
+ */
+void dbg_merge(dbg_t* G, const dbg_t* H, size_t num_threads);
+
+
 /* Add the k-mers contained in a sequence to the de bruijn graph. */
 void dbg_add_twobit_seq(dbg_t* G, rng_t* rng, const twobit_t* seq);
 
 
-/* Dump the graph to a readable file. */
+/* Add the k-mers contained in a nucleotide string of length len to the de
+ * bruijn graph. This is the same as dbg_add_twobit_seq, but reads the k-mers
+ * straight from the string, and skips any containing ambiguous nucleotides. */
+void dbg_add_seq(dbg_t* G, rng_t* rng, const char* seq, size_t len);
+
+
+/* Partitioned ingest.
+ *
+ * Rather than adding each k-mer to the filter as it's read, which means a
+ * cache miss (or several) for nearly every k-mer on a large graph, k-mers can
+ * be added in two phases. First, they are buffered with dbg_partition_seq,
+ * grouped by the region of the filter they fall in. Then dbg_add_partitions
+ * sorts each group by slice, and inserts the buffered k-mers a slice at a
+ * time, each group by one thread, so that the random accesses are confined to
+ * a megabyte or two. With two sets of partitions, threads can go back to
+ * buffering into one as soon as they run out of groups to add from the other.
+ *
+ * Each thread should buffer into its own dbg_partitions_t. Seeds are still
+ * added in the first phase. */
+typedef struct dbg_partitions_t_ dbg_partitions_t;
+
+dbg_partitions_t* dbg_partitions_alloc(const dbg_t* G);
+void dbg_partitions_free(dbg_partitions_t* P);
+
+/* Number of k-mers buffered. */
+size_t dbg_partitions_size(const dbg_partitions_t* P);
+
+/* Buffer the k-mers in a sequence, as dbg_add_seq would add them. */
+void dbg_partition_seq(dbg_t* G, dbg_partitions_t* P, rng_t* rng,
+                       const char* seq, size_t len);
+
+/* Add the k-mers buffered in the n partitions Ps to the graph, and empty
+ * them.
+ *
+ * Any number of threads can call this at once with the same arguments to
+ * share the work, claiming groups of slices through next_group, which must be
+ * zero to begin with. The partitions are empty once every call has returned,
+ * and should not be buffered into before then. */
+void dbg_add_partitions(dbg_t* G, dbg_partitions_t* const* Ps, size_t n,
+                        size_t* next_group);
+
+
+/* Number of k-mers dbg_add_seq has skipped for containing nucleotides other
+ * than A, C, G, or T. */
+size_t dbg_ambiguous_count(const dbg_t* G);
+
+
+/* Dump the graph to a readable file, either as an adjacency matrix, with a
+ * row and column for each k-mer, or as unitigs, the graph's unbranching paths
+ * compacted into sequences: in FASTA format, with the links between them in
+ * their headers, or in GFA 1.0.
+ *
+ * The graph is not modified, so it can be dumped again, in any format. */
 typedef enum {
     ADJ_GRAPH_FMT_MM,
-    ADJ_GRAPH_FMT_HB
+    ADJ_GRAPH_FMT_HB,
+    ADJ_GRAPH_FMT_UNITIGS,
+    ADJ_GRAPH_FMT_GFA
 } adj_graph_fmt_t;
 
 void dbg_dump(const dbg_t* G, FILE* fout, size_t num_threads,
@@ -1,24 +1,27 @@
-
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "fastq.h"
 #include "misc.h"
 
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 
 static void str_init(str_t* str)
 {
     str->n = 0;
     str->size = 128;
-    str->s = malloc_or_die(str->size);
-    str->s[0] = '\0';
+    str->s = str->buf = malloc_or_die(str->size);
 }
 
 
 static void str_free(str_t* str)
 {
-    free(str->s);
+    free(str->buf);
 }
 
 
@@ -30,18 +33,41 @@ static void str_reserve_extra(str_t* str, size_t size)
             str->size = str->n + size;
         }
         else str->size *= 2;
-        str->s = realloc_or_die(str->s, str->size * sizeof(char));
+        str->buf = realloc_or_die(str->buf, str->size * sizeof(char));
+        str->s = str->buf;
     }
 }
 
 
-/* Copy n characters from c to the end of str. */
+/* If str points into a parser's buffer, copy it into its own storage. */
+static void str_own(str_t* str)
+{
+    if (str->s == str->buf) return;
+
+    const char* s = str->s;
+    size_t n = str->n;
+    str->s = str->buf;
+    str->n = 0;
+    str_reserve_extra(str, n);
+    memcpy(str->buf, s, n);
+    str->n = n;
+}
+
+
+/* Append n characters from c to the end of str. An empty str is just pointed
+ * at c, so the common case of a field on a single line is never copied. */
 static void str_append(str_t* str, char* c, size_t n)
 {
+    if (str->n == 0) {
+        str->s = c;
+        str->n = n;
+        return;
+    }
+
+    str_own(str);
     str_reserve_extra(str, n);
     memcpy(str->s + str->n, c, n);
     str->n += n;
-    str->s[str->n] = '\0';
 }
 
 
@@ -66,34 +92,123 @@ void seq_free(seq_t* seq)
 }
 
 
+static void seq_own(seq_t* seq)
+{
+    str_own(&seq->id1);
+    str_own(&seq->seq);
+    str_own(&seq->id2);
+    str_own(&seq->qual);
+}
+
+
 static const size_t parser_buf_size = 1000000;
 
 
 struct fastq_t_
 {
     FILE* file;
-    size_t readlen;
+
+    /* Offset in the file at which parsing started, for fastq_rewind. */
+    off_t start;
+
+    /* The whole file, if it could be memory mapped. */
+    char* map;
+    size_t map_size;
+
+    /* Buffer owned by the parser. */
+    char* mem;
+    size_t size;
+
+    /* Data being parsed, either mem or a span of map. */
     char* buf;
+    size_t readlen;
     char* next;
     bool linestart;
 };
 
 
+/* Try to memory map the rest of a regular file, so it can be parsed without
+ * reading it into a buffer. */
+static void fastq_map(fastq_t* f)
+{
+#if HAVE_MMAP
+    struct stat st;
+    off_t offset = f->start;
+    if (fstat(fileno(f->file), &st) != 0 || !S_ISREG(st.st_mode) ||
+        offset >= st.st_size) {
+        return;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                     fileno(f->file), 0);
+    if (map == MAP_FAILED) return;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    f->map = map;
+    f->map_size = st.st_size;
+    f->next = f->buf = f->map + offset;
+    f->readlen = st.st_size - offset;
+#else
+    UNUSED(f);
+#endif
+}
+
 
 fastq_t* fastq_create(FILE* file)
 {
     fastq_t* f = malloc_or_die(sizeof(fastq_t));
     f->file = file;
-    f->next = f->buf = malloc_or_die(parser_buf_size);
+    f->start = 0;
+    f->map = NULL;
+    f->map_size = 0;
+    f->size = parser_buf_size;
+    f->next = f->buf = f->mem = malloc_or_die(f->size);
     f->readlen = 0;
     f->linestart = true;
+
+    if (file) {
+        f->start = ftello(file);
+        if (f->start < 0) f->start = 0;
+        fastq_map(f);
+    }
+
     return f;
 }
 
 
+/* Grow the buffer to hold at least size bytes. This discards the parser
+ * state, so is only used between chunks. */
+static void fastq_reserve(fastq_t* f, size_t size)
+{
+    if (f->size < size) {
+        f->size = size;
+        f->mem = realloc_or_die(f->mem, f->size);
+    }
+    f->next = f->buf = f->mem;
+}
+
+
+/* Fill the buffer from the file, if there is one and it isn't mapped. Any of
+ * seq pointing into the buffer is copied out first. */
+static void fastq_refill(fastq_t* f, seq_t* seq)
+{
+    if (f->file == NULL || f->map) {
+        f->readlen = 0;
+        return;
+    }
+
+    seq_own(seq);
+    f->readlen = fread(f->buf, 1, f->size, f->file);
+    f->next = f->buf;
+}
+
+
 void fastq_free(fastq_t* f)
 {
-    free(f->buf);
+#if HAVE_MMAP
+    if (f->map) munmap(f->map, f->map_size);
+#endif
+    free(f->mem);
     free(f);
 }
 
@@ -140,12 +255,11 @@ bool fasta_read(fastq_t* f, seq_t* seq)
         }
 
         /* Try to read more. */
-        f->readlen = fread(f->buf, 1, parser_buf_size, f->file);
-        f->next = f->buf;
+        fastq_refill(f, seq);
         end = f->buf + f->readlen;
     } while (f->readlen);
 
-    return false;
+    return state != FASTA_STATE_INIT;
 }
 
 
@@ -206,8 +320,7 @@ bool fastq_read(fastq_t* f, seq_t* seq)
         }
 
         /* Try to read more. */
-        f->readlen = fread(f->buf, 1, parser_buf_size, f->file);
-        f->next = f->buf;
+        fastq_refill(f, seq);
         end = f->buf + f->readlen;
     } while (f->readlen);
 
@@ -215,21 +328,135 @@ bool fastq_read(fastq_t* f, seq_t* seq)
 }
 
 
+/* Offset of the last FASTA entry in buf, which may be incomplete, or 0 if
+ * there is only one. Entries begin with a '>' at the start of a line. */
+static size_t fasta_last_boundary(const char* buf, size_t n)
+{
+    size_t i;
+    for (i = n - 1; i > 0; --i) {
+        if (buf[i] == '>' && buf[i - 1] == '\n') return i;
+    }
+
+    return 0;
+}
+
+
+/* Offset of the last FASTQ entry in buf, which may be incomplete, or 0 if
+ * there is only one. Entries begin with a '@' at the start of a line, but so
+ * can quality scores, so the entry's third line must also begin with a '+'.
+ * As in fastq_read, entries are assumed to be four lines. */
+static size_t fastq_last_boundary(const char* buf, size_t n)
+{
+    const char* end = buf + n;
+    const char* c;
+    size_t i;
+    for (i = n - 1; i > 0; --i) {
+        if (buf[i] != '@' || buf[i - 1] != '\n') continue;
+
+        c = memchr(buf + i, '\n', n - i);
+        if (c) c = memchr(c + 1, '\n', end - (c + 1));
+        if (c && c + 1 < end && c[1] == '+') return i;
+    }
+
+    return 0;
+}
+
+
+/* Take a chunk from a memory mapped file, without copying. */
+static bool fastq_map_chunk(fastq_t* f, fastq_t* chunk,
+                            size_t (*last_boundary)(const char*, size_t))
+{
+    size_t n = (f->buf + f->readlen) - f->next;
+    if (n == 0) return false;
+
+    size_t boundary = 0, len = parser_buf_size;
+    while (len < n && (boundary = last_boundary(f->next, len)) == 0) {
+        len *= 2;
+    }
+    if (len >= n) boundary = n;
+
+    chunk->next = chunk->buf = f->next;
+    chunk->readlen = boundary;
+    chunk->linestart = true;
+    f->next += boundary;
+
+    return true;
+}
+
+
+static bool fastq_read_chunk_(fastq_t* f, fastq_t* chunk,
+                              size_t (*last_boundary)(const char*, size_t))
+{
+    if (f->map) return fastq_map_chunk(f, chunk, last_boundary);
+
+    /* Start with the partial entry left over from the last chunk. */
+    size_t n = (f->buf + f->readlen) - f->next;
+    fastq_reserve(chunk, n > parser_buf_size ? n : parser_buf_size);
+    memcpy(chunk->buf, f->next, n);
+
+    /* Read until we have a full buffer with at least one whole entry, or
+     * reach the end of the file. */
+    size_t boundary;
+    while (true) {
+        n += fread(chunk->buf + n, 1, chunk->size - n, f->file);
+        if (n < chunk->size) {
+            boundary = n;
+            break;
+        }
+
+        boundary = last_boundary(chunk->buf, n);
+        if (boundary > 0) break;
+
+        /* A single entry larger than the buffer. */
+        fastq_reserve(chunk, 2 * chunk->size);
+    }
+
+    /* Hand the trailing partial entry back to the reader. */
+    fastq_reserve(f, n - boundary);
+    memcpy(f->buf, chunk->buf + boundary, n - boundary);
+    f->readlen = n - boundary;
+
+    chunk->readlen = boundary;
+    chunk->linestart = true;
+
+    return boundary > 0;
+}
+
+
+bool fasta_read_chunk(fastq_t* f, fastq_t* chunk)
+{
+    return fastq_read_chunk_(f, chunk, fasta_last_boundary);
+}
+
+
+bool fastq_read_chunk(fastq_t* f, fastq_t* chunk)
+{
+    return fastq_read_chunk_(f, chunk, fastq_last_boundary);
+}
+
+
 void fastq_rewind(fastq_t* f)
 {
-    rewind(f->file);
-    f->next = f->buf;
-    f->readlen = 0;
+    fseeko(f->file, f->start, SEEK_SET);
+    if (f->map) {
+        f->next = f->buf = f->map + f->start;
+        f->readlen = f->map_size - f->start;
+    }
+    else {
+        f->next = f->buf = f->mem;
+        f->readlen = 0;
+    }
+    f->linestart = true;
 }
 
 
 void fastq_print(FILE* fout, const seq_t* seq)
 {
-    fprintf(fout, "@%s\n%s\n+%s\n%s\n",
-                  seq->id1.s,
-                  seq->seq.s,
-                  seq->id2.s,
-                  seq->qual.s );
+    fprintf(fout, "@%.*s\n%.*s\n+%.*s\n%.*s\n",
+                  (int) seq->id1.n, seq->id1.s,
+                  (int) seq->seq.n, seq->seq.s,
+                  (int) seq->id2.n, seq->id2.s,
+                  (int) seq->qual.n, seq->qual.s );
 }
 
 
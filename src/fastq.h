@@ -15,12 +15,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-/* A string structure to keep-track of a reserved space. */
+/* A string structure to keep-track of a reserved space.
+ *
+ * To avoid copying, s may point directly into the parser's buffer (or a
+ * memory mapped file) rather than buf. It is therefore not null-terminated,
+ * and is only valid until the next entry is read.
+ */
 typedef struct
 {
-    char*  s;    /* null-terminated string */
+    char*  s;    /* string */
     size_t n;    /* length of s */
-    size_t size; /* bytes allocated for s */
+    char*  buf;  /* reserved space, used when s can not point into the input */
+    size_t size; /* bytes allocated for buf */
 } str_t;
 
 
@@ -47,9 +53,12 @@ typedef struct fastq_t_ fastq_t;
 
 
 /* Create a new fastq parser object.
+ *
+ * Regular files are memory mapped, rather than read into a buffer.
  *
  * Args:
- *   file: A file that has been opened for reading.
+ *   file: A file that has been opened for reading, or NULL for a parser that
+ *         is only fed with fastq_read_chunk (fasta_read_chunk, resp.).
  */
 fastq_t* fastq_create(FILE* file);
 
@@ -71,7 +80,23 @@ bool fastq_read(fastq_t* f, seq_t* seq);
 bool fasta_read(fastq_t* f, seq_t* seq);
 
 
-/* Rewind the fastq file.
+/* Read a block of whole fastq (fasta, resp.) entries, so they can be parsed
+ * apart from the file, in parallel with other chunks.
+ *
+ * Args:
+ *   f: A fastq_t parser object reading from a file. Once read from in
+ *      chunks, it should only be read from in chunks.
+ *   chunk: A fastq_t parser object created with a NULL file. Entries are then
+ *          read from it with fastq_read (fasta_read, resp.) until exhausted.
+ *
+ * Returns:
+ *   True if a chunk was read, false if end-of-file was reached.
+ */
+bool fastq_read_chunk(fastq_t* f, fastq_t* chunk);
+bool fasta_read_chunk(fastq_t* f, fastq_t* chunk);
+
+
+/* Rewind the fastq file to where it was when passed to fastq_create.
  *
  * The FILE passed to fastq_create must be seekable for this to work.
  */
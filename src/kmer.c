@@ -155,33 +155,51 @@ bool kmer_simple(kmer_t x, size_t k)
 }
 
 
-/* This is Thomas Wang's hash function for 64-bit integers. */
-uint64_t kmer_hash(kmer_t x)
+static uint64_t rotl64(uint64_t x, int r)
 {
-    x = (~x) + (x << 21);
-    x = x ^ (x >> 24);
-    x = (x + (x << 3)) + (x << 8); // x * 265
-    x = x ^ (x >> 14);
-    x = (x + (x << 2)) + (x << 4); // x * 21
-    x = x ^ (x >> 28);
-    x = x + (x << 31);
-    return x;
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
 
-/* This is taken from the Hash128to64 function in CityHash */
-uint64_t kmer_hash_mix(uint64_t h1, uint64_t h2)
+/* This is MurmurHash3_x64_128, by Austin Appleby, with a seed of zero,
+ * specialized to an 8-byte key. */
+kmer_hash128_t kmer_hash128(kmer_t x)
 {
-    static const uint64_t c1 = 0x9ae16a3b2f90404fULL;
-    static const uint64_t c2 = 0x9ddfea08eb382d69ULL;
-
-    h1 -= c1;
-    uint64_t a = (h1 ^ h2) * c2;
-    a ^= (a >> 47);
-    uint64_t b = (h2 ^ a) * c2;
-    b ^= (b >> 47);
-    b *= c2;
-    return b;
+    static const uint64_t c1 = 0x87c37b91114253d5ULL;
+    static const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    uint64_t h1 = 0, h2 = 0;
+
+    x *= c1;
+    x = rotl64(x, 31);
+    x *= c2;
+    h1 ^= x;
+
+    h1 ^= sizeof(kmer_t);
+    h2 ^= sizeof(kmer_t);
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    kmer_hash128_t h = {h1, h2};
+    return h;
 }
 
 
@@ -49,9 +49,20 @@ kmer_t kmer_canonical(kmer_t, size_t k);
 /* are fewer than all four nucleotides present in the kmer */
 bool kmer_simple(kmer_t, size_t k);
 
-/* hash functions for kmers */
-uint64_t kmer_hash(kmer_t);
-uint64_t kmer_hash_mix(uint64_t a, uint64_t b);
+/* A 128-bit hash of a k-mer. It is computed once per k-mer, and split up
+ * between the structures that need one, rather than each rehashing.
+ *
+ * Currently lo gives the filter its fingerprint, and seeds the kmerset's
+ * probes, while the high bits of hi give the seed cache its cell, and the low
+ * bits decide whether the k-mer is sampled as a seed at all. The filter's
+ * subtable indices combine both, as hi + i * lo, but with the top bits of hi
+ * choosing the filter's slice. */
+typedef struct kmer_hash128_t_
+{
+    uint64_t lo, hi;
+} kmer_hash128_t;
+
+kmer_hash128_t kmer_hash128(kmer_t);
 
 #endif
 
@@ -5,8 +5,10 @@
 #include "kmercache.h"
 #include "misc.h"
 
-/* Coarseness of the locking. */
+#if !HAVE_CAS16
+/* Coarseness of the locking, where locking is needed. */
 static const size_t cells_per_mutex = 16;
+#endif
 
 /* Base probability of the current occupant being booted upon collision. */
 static const double base_rep_pr = 0.9;
@@ -16,15 +18,28 @@ kmercache_t* kmercache_alloc(size_t n)
 {
     kmercache_t* C = malloc_or_die(sizeof(kmercache_t));
     C->n = n;
-    C->xs = malloc_or_die(n * sizeof(kmercache_cell_t));
+    C->xs = aligned_malloc_or_die(sizeof(kmercache_cell_t),
+                                  n * sizeof(kmercache_cell_t));
     memset(C->xs, 0, n * sizeof(kmercache_cell_t));
 
+    /* base_rep_pr^count, in fixed point, so evictions can be decided by
+     * comparing against a random integer. */
+    size_t i;
+    double pr;
+    for (i = 0; i < KMERCACHE_MAX_REP_COUNT; ++i) {
+        pr = ldexp(pow(base_rep_pr, (double) i), 32);
+        C->rep_pr[i] = pr < (double) UINT32_MAX ? (uint32_t) pr : UINT32_MAX;
+    }
+
+#if HAVE_CAS16
+    C->mutexes = NULL;
+#else
     size_t num_mutexes = (n + cells_per_mutex - 1) / cells_per_mutex;
     C->mutexes = malloc_or_die(num_mutexes * sizeof(pthread_mutex_t));
-    size_t i;
     for (i = 0; i < num_mutexes; ++i) {
         pthread_mutex_init_or_die(&C->mutexes[i], NULL);
     }
+#endif
 
     return C;
 }
@@ -32,36 +47,106 @@ kmercache_t* kmercache_alloc(size_t n)
 
 void kmercache_free(kmercache_t* C)
 {
+#if !HAVE_CAS16
     size_t i, num_mutexes = (C->n + cells_per_mutex - 1) / cells_per_mutex;
     for (i = 0; i < num_mutexes; ++i) {
         pthread_mutex_destroy(&C->mutexes[i]);
     }
     free(C->mutexes);
+#endif
     free(C->xs);
     free(C);
 }
 
 
-uint32_t kmercache_inc(kmercache_t* C, rng_t* rng, kmer_t x)
+/* Should an occupant with the given count be evicted by a colliding key? */
+static bool kmercache_evict(const kmercache_t* C, rng_t* rng, uint32_t count)
+{
+    if (count == 0) return true;
+    if (count >= KMERCACHE_MAX_REP_COUNT) return false;
+    return rng_get(rng) < C->rep_pr[count];
+}
+
+
+#if HAVE_CAS16
+
+__extension__ typedef unsigned __int128 cell_bits_t;
+
+/* Cells as seen by the compare-and-swap. Cells are only ever written whole,
+ * through this, from values with the padding zeroed, so the padding is always
+ * zero and compares equal. */
+typedef union cell_t_
+{
+    kmercache_cell_t cell;
+    cell_bits_t bits;
+} cell_t;
+
+
+static uint32_t kmercache_add_hashed(kmercache_t* C, rng_t* rng, kmer_t x,
+                                     kmer_hash128_t h, uint32_t d)
+{
+    kmercache_cell_t* cell = &C->xs[fastrange64(h.hi, C->n)];
+    cell_t cur, next;
+    next.bits = 0;
+    next.cell.x = x;
+
+    while (true) {
+        /* The two fields are read separately, and may be torn by a concurrent
+         * update, in which case the compare-and-swap fails and we try again. */
+        cur.bits = 0;
+        cur.cell.x     = __atomic_load_n(&cell->x, __ATOMIC_RELAXED);
+        cur.cell.count = __atomic_load_n(&cell->count, __ATOMIC_RELAXED);
+
+        if (cur.cell.x == x) {
+            next.cell.count = cur.cell.count < UINT32_MAX - d ?
+                              cur.cell.count + d : UINT32_MAX;
+        }
+        else if (kmercache_evict(C, rng, cur.cell.count)) {
+            next.cell.count = d;
+        }
+        else return 0;
+
+        if (__sync_bool_compare_and_swap((cell_bits_t*) cell,
+                                         cur.bits, next.bits)) {
+            return next.cell.count;
+        }
+    }
+}
+
+#else
+
+static uint32_t kmercache_add_hashed(kmercache_t* C, rng_t* rng, kmer_t x,
+                                     kmer_hash128_t h, uint32_t d)
 {
-    uint64_t i = kmer_hash(x) % C->n;
+    uint64_t i = fastrange64(h.hi, C->n);
     uint32_t count = 0;
     pthread_mutex_lock(&C->mutexes[i / cells_per_mutex]);
 
     if (C->xs[i].x == x) {
-        if (C->xs[i].count < UINT32_MAX) ++C->xs[i].count;
+        if (C->xs[i].count < UINT32_MAX - d) C->xs[i].count += d;
+        else                                 C->xs[i].count = UINT32_MAX;
         count = C->xs[i].count;
     }
-    else {
-        double pr = pow(base_rep_pr, (double) C->xs[i].count);
-        double r = rng_get_double(rng);
-        if (r < pr) {
-            C->xs[i].x = x;
-            count = C->xs[i].count = 1;
-        }
+    else if (kmercache_evict(C, rng, C->xs[i].count)) {
+        C->xs[i].x = x;
+        count = C->xs[i].count = d;
     }
 
     pthread_mutex_unlock(&C->mutexes[i / cells_per_mutex]);
     return count;
 }
 
+#endif
+
+
+uint32_t kmercache_inc(kmercache_t* C, rng_t* rng, kmer_t x, kmer_hash128_t h)
+{
+    return kmercache_add_hashed(C, rng, x, h, 1);
+}
+
+
+uint32_t kmercache_add(kmercache_t* C, rng_t* rng, kmer_t x, uint32_t d)
+{
+    return kmercache_add_hashed(C, rng, x, kmer_hash128(x), d);
+}
+
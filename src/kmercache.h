@@ -20,21 +20,29 @@
 #include "kmer.h"
 #include "rng.h"
 
+/* Cells are aligned so they can be replaced whole, with one compare-and-swap.
+ */
 typedef struct kmercache_cell_t_
 {
     kmer_t x;
     uint32_t count;
-} kmercache_cell_t;
+} __attribute__((aligned(16))) kmercache_cell_t;
+
 
+/* Occupants with at least this count are never evicted. */
+#define KMERCACHE_MAX_REP_COUNT 256
 
 typedef struct kmercache_t_
 {
     kmercache_cell_t* xs;
-    pthread_mutex_t* mutexes;
     size_t n;
 
-    rng_t* rng;
-    pthread_mutex_t rng_mutex;
+    /* Locks, only where a 16-byte compare-and-swap is unavailable. */
+    pthread_mutex_t* mutexes;
+
+    /* The probability of the occupant of a cell with the given count being
+     * evicted by a colliding key, in units of 2^-32. */
+    uint32_t rep_pr[KMERCACHE_MAX_REP_COUNT];
 } kmercache_t;
 
 
@@ -48,17 +56,29 @@ void kmercache_free(kmercache_t* C);
 
 /* Increment the count of the the key x.
  *
- * The key is added if it's not present.
+ * The key is added if it's not present. This is safe to call from many
+ * threads at once, each with its own rng.
  *
  * Args:
  *   C: kmer cache
+ *   rng: random number generator, deciding evictions
  *   x: key
+ *   h: the key's hash, from kmer_hash128
  *
  * Returns:
  *   The new count associated with the key, which can be 0 if the key could not
  *   be inserted.
  */
-uint32_t kmercache_inc(kmercache_t* C, rng_t* rng, kmer_t x);
+uint32_t kmercache_inc(kmercache_t* C, rng_t* rng, kmer_t x, kmer_hash128_t h);
+
+
+/* Increase the count of the key x by d.
+ *
+ * This is kmercache_inc, but as though x had been seen d times at once: a
+ * key being added displaces the current occupant with the probability it
+ * would have the first time, but starts with count d.
+ */
+uint32_t kmercache_add(kmercache_t* C, rng_t* rng, kmer_t x, uint32_t d);
 
 #endif
 
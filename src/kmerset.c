@@ -4,30 +4,20 @@
 #include "kmerset.h"
 #include "misc.h"
 
-/* Prime numbers that a near powers of two, suitable for hash table sizes, when
- * using quadratic probing. */
-#define NUM_PRIMES 28
-static const uint32_t primes[NUM_PRIMES] = {
-           53U,         97U,        193U,        389U,
-          769U,       1543U,       3079U,       6151U,
-        12289U,      24593U,      49157U,      98317U,
-       196613U,     393241U,     786433U,    1572869U,
-      3145739U,    6291469U,   12582917U,   25165843U,
-     50331653U,  100663319U,  201326611U,  402653189U,
-    805306457U, 1610612741U, 3221225473U, 4294967291U };
+/* Tables sizes are powers of two, so cells are found by masking the hash
+ * rather than dividing, starting at this size. */
+static const size_t MIN_SIZE = 64;
 
 
 /* Load factor before resize. */
 static const double MAX_LOAD  = 0.7;
 
 
-/* simple quadratic probing */
-static uint32_t probe(uint32_t h, uint32_t i)
+/* Triangular probing: the i-th probe is i(i+1)/2 cells past the first, which,
+ * with a power of two table size, visits every cell before repeating. */
+static size_t probe(uint64_t h, size_t i)
 {
-    static const uint32_t c1 = 2;
-    static const uint32_t c2 = 2;
-
-    return h + i/c1 + (i*i)/c2;
+    return h + i * (i + 1) / 2;
 }
 
 
@@ -42,7 +32,7 @@ struct kmerset_t_
 {
     kmerset_cell_t* xs;
 
-    /* Size of xs. */
+    /* Size of xs, a power of two. */
     size_t size;
 
     /* Number of non-empty cells. */
@@ -57,10 +47,10 @@ kmerset_t* kmerset_alloc()
 {
     kmerset_t* H = malloc_or_die(sizeof(kmerset_t));
     H->n = 0;
-    H->size = 0;
-    H->max_n = (uint32_t) (MAX_LOAD * (double) primes[H->size]);
-    H->xs = malloc_or_die(primes[H->size] * sizeof(kmerset_cell_t));
-    memset(H->xs, 0, primes[H->size] * sizeof(kmerset_cell_t));
+    H->size = MIN_SIZE;
+    H->max_n = (size_t) (MAX_LOAD * (double) H->size);
+    H->xs = malloc_or_die(H->size * sizeof(kmerset_cell_t));
+    memset(H->xs, 0, H->size * sizeof(kmerset_cell_t));
     return H;
 }
 
@@ -80,17 +70,18 @@ size_t kmerset_size(const kmerset_t* H)
 
 static void kmerset_expand(kmerset_t* H)
 {
-    ++H->size;
-    kmerset_cell_t* xs = malloc_or_die(primes[H->size] * sizeof(kmerset_cell_t));
-    memset(xs, 0, primes[H->size] * sizeof(kmerset_cell_t));
-
-    uint32_t probe_num, h, k;
-    size_t i;
-    for (i = 0; i < primes[H->size - 1]; ++i) {
+    size_t size = 2 * H->size;
+    size_t mask = size - 1;
+    kmerset_cell_t* xs = malloc_or_die(size * sizeof(kmerset_cell_t));
+    memset(xs, 0, size * sizeof(kmerset_cell_t));
+
+    uint64_t h;
+    size_t i, k, probe_num;
+    for (i = 0; i < H->size; ++i) {
         if (H->xs[i].idx != 0) {
-            probe_num = 1;
-            h = kmer_hash(H->xs[i].x);
-            k = h % primes[H->size];
+            probe_num = 0;
+            h = kmer_hash128(H->xs[i].x).lo;
+            k = h & mask;
             while (true) {
                 if (xs[k].idx == 0) {
                     xs[k].x   = H->xs[i].x;
@@ -98,47 +89,50 @@ static void kmerset_expand(kmerset_t* H)
                     break;
                 }
 
-                k = probe(h, ++probe_num) % primes[H->size];
+                k = probe(h, ++probe_num) & mask;
             }
         }
     }
 
     free(H->xs);
     H->xs = xs;
-    H->max_n = (uint32_t) (MAX_LOAD * (double) primes[H->size]);
+    H->size = size;
+    H->max_n = (size_t) (MAX_LOAD * (double) H->size);
 }
 
 
-void kmerset_add(kmerset_t* H, kmer_t x)
+uint32_t kmerset_add(kmerset_t* H, kmer_t x)
 {
     if (H->n >= H->max_n) {
         kmerset_expand(H);
     }
 
-    uint32_t probe_num = 1;
-    uint32_t h = kmer_hash(x);
-    uint32_t k = h % primes[H->size];
+    size_t mask = H->size - 1;
+    size_t probe_num = 0;
+    uint64_t h = kmer_hash128(x).lo;
+    size_t k = h & mask;
 
     while (true) {
         if (H->xs[k].idx == 0) {
             H->xs[k].x = x;
             H->xs[k].idx = ++H->n;
-            return;
+            return H->xs[k].idx;
         }
         else if (H->xs[k].x == x) {
-            return;
+            return H->xs[k].idx;
         }
 
-        k = probe(h, ++probe_num) % primes[H->size];
+        k = probe(h, ++probe_num) & mask;
     }
 }
 
 
 uint32_t kmerset_get(const kmerset_t* H, kmer_t x)
 {
-    uint32_t probe_num = 1;
-    uint32_t h = kmer_hash(x);
-    uint32_t k = h % primes[H->size];
+    size_t mask = H->size - 1;
+    size_t probe_num = 0;
+    uint64_t h = kmer_hash128(x).lo;
+    size_t k = h & mask;
 
     while (true) {
         if (H->xs[k].idx == 0) {
@@ -148,8 +142,8 @@ uint32_t kmerset_get(const kmerset_t* H, kmer_t x)
             return H->xs[k].idx;
         }
 
-        k = probe(h, ++probe_num) % primes[H->size];
-        if (k == h % primes[H->size]) return 0;
+        if (++probe_num == H->size) return 0;
+        k = probe(h, probe_num) & mask;
     }
 }
 
@@ -11,7 +11,9 @@ void kmerset_free(kmerset_t*);
 
 size_t kmerset_size(const kmerset_t* H);
 
-void kmerset_add(kmerset_t* H, kmer_t x);
+/* Add a kmer to the set, if it's not already present, returning its index, as
+ * kmerset_get would. */
+uint32_t kmerset_add(kmerset_t* H, kmer_t x);
 
 /* Return the (one-based) index of the kmer in the set.
  *
@@ -26,6 +26,19 @@ void* malloc_or_die(size_t n)
 }
 
 
+/* Allocate n bytes aligned to align, which must be a power of two multiple of
+ * sizeof(void*). The result is freed with free. */
+void* aligned_malloc_or_die(size_t align, size_t n)
+{
+    void* p;
+    if (posix_memalign(&p, align, n) != 0) {
+        fprintf(stderr, "Can not allocate %zu bytes.\n", n);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+
 void* realloc_or_die(void* ptr, size_t n)
 {
     void* p = realloc(ptr, n);
@@ -24,6 +24,7 @@ extern bool pique_verbose;
 
 void* malloc_or_die(size_t);
 void* realloc_or_die(void*, size_t);
+void* aligned_malloc_or_die(size_t align, size_t n);
 FILE* fopen_or_die(const char*, const char*);
 void pthread_mutex_init_or_die(pthread_mutex_t* mutex,
                                const pthread_mutexattr_t* attr);
@@ -36,6 +37,22 @@ void pthread_mutex_init_or_die(pthread_mutex_t* mutex,
 
 #define UNUSED(x) (void)(x)
 
+
+/* Map a 64-bit hash h uniformly onto [0, n) by taking the high word of h * n,
+ * which is much cheaper than h % n. See: Lemire, D. (2019). Fast random
+ * integer generation in an interval. ACM TOMACS, 29(1).
+ *
+ * This relies on the high bits of h being well mixed. */
+static inline uint64_t fastrange64(uint64_t h, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 uint128_t;
+    return (uint64_t) (((uint128_t) h * n) >> 64);
+#else
+    return h % n;
+#endif
+}
+
 /* Windows reads/writes in "text mode" by default. This is confusing
  * and wrong, so we need to disable it.
  */
@@ -1,7 +1,10 @@
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "dbg.h"
 #include "fastq.h"
@@ -12,19 +15,57 @@ void print_help(FILE* fout)
 {
     fprintf(fout,
 "Usage: pique [option]... [file]... > out.mm\n"
+"   or: pique merge [option]... graph... > out.mm\n"
 "Assemble short sequencing reads into contigs, take no prisoners.\n\n"
 "By default, output is an adjacency matrix representation of the\n"
 "De Bruijn graph in matrix market exchange format.\n\n"
+"With merge, graphs saved with --save, e.g. from separate sets of reads, are\n"
+"combined into one, which can be output or saved as usual. Merging two graphs\n"
+"needs memory for a third as large as the larger of them. Each graph keeps a\n"
+"fixed number of seeds to start traversal from, so a part of the merged graph\n"
+"whose seeds were all crowded out may be missing from its output.\n\n"
 "Options:\n"
 "  --fastq              input is in FASTQ format\n"
 "  --fasta              input is in FASTA format (default)\n"
 "  --mm                 output an adjacency matrix in matrix market format (default)\n"
 "  --hb                 output an adjacency matrix in harwell-boeing format\n"
+"  --unitigs            output unitigs, the graph's unbranching paths, in FASTA\n"
+"                       format, with links between them in their headers\n"
+"  --gfa                output unitigs and the links between them in GFA 1.0\n"
+"                       format\n"
 "  -n                   maxmimum number of unique k-mers (larger numbers use\n"
 "                       more memory but allow potentially more accurate assembly\n"
 "                       (default: 100000000)\n"
 "  -k                   k-mer size used by the de bruijn (default: 25)\n"
+"  --counter-bits N     bits of each 32-bit filter cell used to count k-mers,\n"
+"                       the rest being a fingerprint: fewer bits mean fewer\n"
+"                       false positives but counts saturate sooner\n"
+"                       (6, 8, 10, 12, or 16; default: 10)\n"
 "  -t, --threads        number of threads to use (default: 1)\n"
+"  --seed-rate S        consider only about one in S k-mers as starting points\n"
+"                       for traversing the graph, which speeds up reading, but\n"
+"                       can miss parts of the graph smaller than S k-mers\n"
+"                       (default: 1)\n"
+"  --solid T            only add k-mers to the graph once they've been seen T\n"
+"                       times, dropping most sequencing errors, so a smaller\n"
+"                       -n suffices (default: 1)\n"
+"  --solid-n N          number of distinct k-mers, errors included, expected\n"
+"                       when using --solid, which takes about N bytes for each\n"
+"                       count below T (default: 4 times the graph's -n)\n"
+"  --min-count N        leave k-mers seen fewer than N times out of the output,\n"
+"                       along with anything reachable only through them\n"
+"                       (default: 1)\n"
+"  --min-ratio F        likewise leave out k-mers with counts less than F times\n"
+"                       that of their most common sibling, e.g. tips and\n"
+"                       bubbles caused by sequencing errors (default: 0)\n"
+"  --partitioned        buffer k-mers and insert them into the graph a region\n"
+"                       at a time, which can be faster when the graph is much\n"
+"                       larger than the CPU cache, but uses an extra 128MB or\n"
+"                       so of memory per thread\n"
+"  --save FILE          save the graph to FILE rather than outputting it\n"
+"  --load FILE          start from a graph saved with --save, adding reads from\n"
+"                       any files given (-n and -k are taken from the graph)\n"
+"  --verify             check a loaded graph against its checksum\n"
 "  -h, --help           print this message\n"
 "  -V, --version        display program version\n\n");
 }
@@ -42,36 +83,138 @@ typedef struct pique_ctx_t_
     fastq_t* f;
     pthread_mutex_t* f_mutex;
     dbg_t* G;
+    size_t num_threads;
+
+    /* With --partitioned, two sets of k-mers buffered by each thread,
+     * otherwise NULL. Threads buffer into one set while the other is being
+     * added to the graph. */
+    dbg_partitions_t** parts[2];
+
+    /* Next group of slices to be added from each set of parts (see
+     * dbg_add_partitions). */
+    size_t next_group[2];
+
+    /* Threads meet here once their parts are full, to add them together. */
+    pthread_barrier_t* barrier;
+
+    /* Index of the next thread to start. */
+    size_t next_id;
+
+    /* With parts, the round of buffering in which the input was exhausted,
+     * or SIZE_MAX. */
+    size_t eof_round;
 } pique_ctx_t;
 
 
+/* K-mers buffered by each thread with --partitioned before they are added to
+ * the graph. */
+static const size_t pique_partition_size = 1 << 22;
+
+
+/* Load and merge saved graphs, exiting on error. */
+static dbg_t* pique_merge(char* const* paths, size_t n, bool verify,
+                          size_t num_threads)
+{
+    if (n == 0) {
+        fprintf(stderr, "No graphs given to merge.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    dbg_t* G = dbg_load(paths[0], verify);
+    dbg_t* H;
+    size_t i;
+    for (i = 1; i < n; ++i) {
+        H = dbg_load(paths[i], verify);
+        dbg_merge(G, H, num_threads);
+        dbg_free(H);
+    }
+
+    return G;
+}
+
+
 void* pique_thread(void* arg)
 {
     pique_ctx_t* ctx = arg;
+    fastq_t* chunk = fastq_create(NULL);
     seq_t* seq = seq_create();
-    twobit_t* tb = twobit_alloc();
     rng_t* rng = rng_alloc(1234);
-    bool r;
+    bool r = false;
+
+    size_t id = __atomic_fetch_add(&ctx->next_id, 1, __ATOMIC_RELAXED);
+    size_t round = 0, set;
+    dbg_partitions_t* P = NULL;
 
     while (true) {
-        pthread_mutex_lock(ctx->f_mutex);
-        if (ctx->fmt == INPUT_FMT_FASTA)      r = fasta_read(ctx->f, seq);
-        else if (ctx->fmt == INPUT_FMT_FASTQ) r = fastq_read(ctx->f, seq);
-        pthread_mutex_unlock(ctx->f_mutex);
-        if (!r) break;
+        set = round % 2;
+        if (ctx->parts[0]) P = ctx->parts[set][id];
+
+        /* Without partitions, read until the input is exhausted. With them,
+         * stop once the buffer is full, so it can be added to the graph. */
+        while (P == NULL || dbg_partitions_size(P) < pique_partition_size) {
+            /* Only splitting the input into chunks is serialized, parsing
+             * them is done in parallel. */
+            pthread_mutex_lock(ctx->f_mutex);
+            if (ctx->fmt == INPUT_FMT_FASTA)      r = fasta_read_chunk(ctx->f, chunk);
+            else if (ctx->fmt == INPUT_FMT_FASTQ) r = fastq_read_chunk(ctx->f, chunk);
+            pthread_mutex_unlock(ctx->f_mutex);
+            if (!r) {
+                __atomic_store_n(&ctx->eof_round, round, __ATOMIC_RELAXED);
+                break;
+            }
+
+            while (true) {
+                if (ctx->fmt == INPUT_FMT_FASTA)      r = fasta_read(chunk, seq);
+                else if (ctx->fmt == INPUT_FMT_FASTQ) r = fastq_read(chunk, seq);
+                if (!r) break;
 
-        /* TODO: remove sequences with Ns? */
+                if (P) dbg_partition_seq(ctx->G, P, rng, seq->seq.s, seq->seq.n);
+                else   dbg_add_seq(ctx->G, rng, seq->seq.s, seq->seq.n);
+            }
+        }
+
+        if (P == NULL) break;
+
+        /* Every thread's parts are added together, once all are full or the
+         * input is exhausted. Threads that run out of slices to add go back
+         * to reading, into the other set, while the rest finish. That set was
+         * last added before this barrier, so its counter can be reset. */
+        if (pthread_barrier_wait(ctx->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            ctx->next_group[set ^ 1] = 0;
+        }
 
-        twobit_copy_str_n(tb, seq->seq.s, seq->seq.n);
-        dbg_add_twobit_seq(ctx->G, rng, tb);
+        dbg_add_partitions(ctx->G, ctx->parts[set], ctx->num_threads,
+                           &ctx->next_group[set]);
+
+        if (__atomic_load_n(&ctx->eof_round, __ATOMIC_RELAXED) <= round) break;
+        ++round;
     }
 
     rng_free(rng);
     seq_free(seq);
+    fastq_free(chunk);
     return NULL;
 }
 
 
+/* Add every sequence in ctx->f to the graph. */
+static void pique_read(pique_ctx_t* ctx, pthread_t* threads)
+{
+    ctx->next_id = 0;
+    ctx->next_group[0] = ctx->next_group[1] = 0;
+    ctx->eof_round = SIZE_MAX;
+
+    size_t i;
+    for (i = 0; i < ctx->num_threads; ++i) {
+        pthread_create(&threads[i], NULL, pique_thread, ctx);
+    }
+
+    for (i = 0; i < ctx->num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
 int main(int argc, char* argv[])
 {
     int opt, opt_idx;
@@ -85,16 +228,58 @@ int main(int argc, char* argv[])
     /* K-mer size. */
     size_t k = 25;
 
+    /* Bits per filter cell given to counts. */
+    unsigned int counter_bits = 10;
+
     /* Number of threads. */
     size_t num_threads = 1;
 
+    /* Sample one in this many k-mers as seeds. */
+    uint32_t seed_rate = 1;
+
+    /* Count k-mers this many times before adding them to the graph, in a
+     * filter sized for solid_n k-mers (or, if 0, four times the graph's
+     * cells, which for a loaded graph needn't be n). */
+    unsigned int solid = 1;
+    size_t solid_n = 0;
+
+    /* Prune k-mers with lower counts, absolute or relative, from output. */
+    uint32_t min_count = 1;
+    double min_ratio = 0.0;
+
+    /* Saved graphs to write or read, if any. */
+    const char* save_path = NULL;
+    const char* load_path = NULL;
+    int verify = false;
+
+    int partitioned = false;
+
+    /* "pique merge" combines saved graphs rather than reading sequences. */
+    bool merge = argc > 1 && strcmp(argv[1], "merge") == 0;
+    if (merge) {
+        --argc;
+        ++argv;
+    }
+
     struct option long_options[] =
     {
         {"fasta",   no_argument,       &in_fmt, INPUT_FMT_FASTA},
         {"fastq",   no_argument,       &in_fmt, INPUT_FMT_FASTQ},
         {"mm",      no_argument,       &out_fmt, ADJ_GRAPH_FMT_MM},
         {"hb",      no_argument,       &out_fmt, ADJ_GRAPH_FMT_HB},
+        {"unitigs", no_argument,       &out_fmt, ADJ_GRAPH_FMT_UNITIGS},
+        {"gfa",     no_argument,       &out_fmt, ADJ_GRAPH_FMT_GFA},
         {"threads", required_argument, NULL, 't'},
+        {"counter-bits", required_argument, NULL, 'c'},
+        {"seed-rate", required_argument, NULL, 'r'},
+        {"solid",   required_argument, NULL, 'o'},
+        {"solid-n", required_argument, NULL, 'O'},
+        {"min-count", required_argument, NULL, 'm'},
+        {"min-ratio", required_argument, NULL, 'M'},
+        {"save",    required_argument, NULL, 's'},
+        {"load",    required_argument, NULL, 'l'},
+        {"verify",  no_argument,       &verify, true},
+        {"partitioned", no_argument,   &partitioned, true},
         {"verbose", no_argument,       NULL, 'v'},
         {"help",    no_argument,       NULL, 'h'},
         {0, 0, 0, 0}
@@ -117,6 +302,38 @@ int main(int argc, char* argv[])
                 num_threads = strtoul(optarg, NULL, 10);
                 break;
 
+            case 'c':
+                counter_bits = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                seed_rate = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'o':
+                solid = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'O':
+                solid_n = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'm':
+                min_count = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'M':
+                min_ratio = strtod(optarg, NULL);
+                break;
+
+            case 's':
+                save_path = optarg;
+                break;
+
+            case 'l':
+                load_path = optarg;
+                break;
+
             case 'v':
                 pique_verbose = true;
                 break;
@@ -137,7 +354,16 @@ int main(int argc, char* argv[])
     }
 
     kmer_init();
-    dbg_t* G = dbg_alloc(n, k);
+    dbg_t* G;
+    if (merge) {
+        G = pique_merge(argv + optind, argc - optind, verify, num_threads);
+        optind = argc;
+    }
+    else if (load_path) G = dbg_load(load_path, verify);
+    else                G = dbg_alloc(n, k, counter_bits);
+    dbg_set_seed_rate(G, seed_rate);
+    dbg_set_solid(G, solid, solid_n);
+    dbg_set_min_count(G, min_count, min_ratio);
 
     pthread_mutex_t f_mutex;
     pthread_mutex_init_or_die(&f_mutex, NULL);
@@ -148,18 +374,26 @@ int main(int argc, char* argv[])
     ctx.fmt = in_fmt;
     ctx.G = G;
     ctx.f_mutex = &f_mutex;
-    size_t i;
-
-    if (optind >= argc) {
-        ctx.f = fastq_create(stdin);
-        for (i = 0; i < num_threads; ++i) {
-            pthread_create(&threads[i], NULL, pique_thread, &ctx);
-        }
-
-        for (i = 0; i < num_threads; ++i) {
-            pthread_join(threads[i], NULL);
+    ctx.num_threads = num_threads;
+    ctx.parts[0] = ctx.parts[1] = NULL;
+    ctx.barrier = NULL;
+    size_t i, j;
+
+    pthread_barrier_t barrier;
+    if (partitioned) {
+        for (j = 0; j < 2; ++j) {
+            ctx.parts[j] = malloc_or_die(num_threads * sizeof(dbg_partitions_t*));
+            for (i = 0; i < num_threads; ++i) {
+                ctx.parts[j][i] = dbg_partitions_alloc(G);
+            }
         }
+        pthread_barrier_init(&barrier, NULL, num_threads);
+        ctx.barrier = &barrier;
+    }
 
+    if (optind >= argc && load_path == NULL && !merge) {
+        ctx.f = fastq_create(stdin);
+        pique_read(&ctx, threads);
         fastq_free(ctx.f);
     } else {
         FILE* file;
@@ -170,22 +404,31 @@ int main(int argc, char* argv[])
                 return EXIT_FAILURE;
             }
             ctx.f = fastq_create(file);
+            pique_read(&ctx, threads);
+            fastq_free(ctx.f);
+        }
+    }
 
-            for (i = 0; i < num_threads; ++i) {
-                pthread_create(&threads[i], NULL, pique_thread, &ctx);
-            }
+    if (pique_verbose) {
+        fprintf(stderr, "%zu k-mers with ambiguous nucleotides skipped.\n",
+                dbg_ambiguous_count(G));
+    }
+
+    if (save_path) dbg_save(G, save_path);
+    else           dbg_dump(G, stdout, num_threads, out_fmt);
 
+    if (partitioned) {
+        for (j = 0; j < 2; ++j) {
             for (i = 0; i < num_threads; ++i) {
-                pthread_join(threads[i], NULL);
+                dbg_partitions_free(ctx.parts[j][i]);
             }
-
-            fastq_free(ctx.f);
+            free(ctx.parts[j]);
         }
+        pthread_barrier_destroy(&barrier);
     }
 
-    dbg_dump(G, stdout, num_threads, out_fmt);
-
     pthread_mutex_destroy(&f_mutex);
+    free(threads);
     dbg_free(G);
     kmer_free();
 
@@ -5,6 +5,10 @@
 #include "crc64.h"
 #include <string.h>
 
+#if HAVE_AVX2 || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 struct twobit_t_
 {
     size_t len; /* length of stored sequence */
@@ -118,15 +122,178 @@ void twobit_append(twobit_t* s, const char* seqstr)
 
 
 void twobit_append_n(twobit_t* s, const char* seqstr, size_t seqlen)
+{
+    twobit_append_n_ambig(s, seqstr, seqlen, NULL);
+}
+
+
+static bool isnuc(char c)
+{
+    c |= 0x20; /* lowercase */
+    return c == 'a' || c == 'c' || c == 'g' || c == 't';
+}
+
+
+/* Spread the bits of x out to every other bit. */
+static uint64_t spread_bits(uint32_t x)
+{
+    uint64_t y = x;
+    y = (y | (y << 16)) & UINT64_C(0x0000ffff0000ffff);
+    y = (y | (y <<  8)) & UINT64_C(0x00ff00ff00ff00ff);
+    y = (y | (y <<  4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+    y = (y | (y <<  2)) & UINT64_C(0x3333333333333333);
+    y = (y | (y <<  1)) & UINT64_C(0x5555555555555555);
+    return y;
+}
+
+
+/* Encoders packing 32 nucleotides into one kmer_t limb, and returning a mask
+ * of the ambiguous positions.
+ *
+ * The vectorized versions rely on bits 1 and 2 of the ASCII codes for
+ * A, C, G, T (in either case) being 00, 01, 11, 10, so the low bit of the
+ * two-bit code is their xor, and the high bit is bit 2. These are split into
+ * bit planes with movemask, and interleaved. */
+typedef uint32_t (*encode32_t)(const char*, kmer_t*);
+
+
+static uint32_t encode32_scalar(const char* seqstr, kmer_t* x)
+{
+    uint32_t ambig = 0;
+    kmer_t y = 0;
+    size_t i;
+    for (i = 0; i < 32; ++i) {
+        if (isnuc(seqstr[i])) {
+            y |= (kmer_t) chartokmer[(uint8_t) seqstr[i]] << (2 * i);
+        }
+        else ambig |= (uint32_t) 1 << i;
+    }
+
+    *x = y;
+    return ambig;
+}
+
+
+#ifdef __SSE2__
+static uint32_t encode16_sse2(const char* seqstr, uint32_t* lo, uint32_t* hi)
+{
+    __m128i c = _mm_loadu_si128((const __m128i*) seqstr);
+    __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i ok = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(l, _mm_set1_epi8('a')),
+                     _mm_cmpeq_epi8(l, _mm_set1_epi8('c'))),
+        _mm_or_si128(_mm_cmpeq_epi8(l, _mm_set1_epi8('g')),
+                     _mm_cmpeq_epi8(l, _mm_set1_epi8('t'))));
+
+    uint32_t ambig = ~_mm_movemask_epi8(ok) & 0xffff;
+    uint32_t b1 = _mm_movemask_epi8(_mm_slli_epi16(c, 6));
+    uint32_t b2 = _mm_movemask_epi8(_mm_slli_epi16(c, 5));
+
+    *lo = (b1 ^ b2) & ~ambig;
+    *hi = b2 & ~ambig;
+    return ambig;
+}
+
+
+static uint32_t encode32_sse2(const char* seqstr, kmer_t* x)
+{
+    uint32_t lo0, hi0, lo1, hi1, ambig;
+    ambig  = encode16_sse2(seqstr, &lo0, &hi0);
+    ambig |= encode16_sse2(seqstr + 16, &lo1, &hi1) << 16;
+
+    *x = spread_bits(lo0 | (lo1 << 16)) | (spread_bits(hi0 | (hi1 << 16)) << 1);
+    return ambig;
+}
+#endif
+
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static uint32_t encode32_avx2(const char* seqstr, kmer_t* x)
+{
+    __m256i c = _mm256_loadu_si256((const __m256i*) seqstr);
+    __m256i l = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i ok = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(l, _mm256_set1_epi8('a')),
+                        _mm256_cmpeq_epi8(l, _mm256_set1_epi8('c'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(l, _mm256_set1_epi8('g')),
+                        _mm256_cmpeq_epi8(l, _mm256_set1_epi8('t'))));
+
+    uint32_t ambig = ~(uint32_t) _mm256_movemask_epi8(ok);
+    uint32_t b1 = _mm256_movemask_epi8(_mm256_slli_epi16(c, 6));
+    uint32_t b2 = _mm256_movemask_epi8(_mm256_slli_epi16(c, 5));
+
+    *x = spread_bits((b1 ^ b2) & ~ambig) | (spread_bits(b2 & ~ambig) << 1);
+    return ambig;
+}
+#endif
+
+
+/* Pick the best encoder the CPU supports. */
+static encode32_t get_encode32()
+{
+    static encode32_t encode32 = NULL;
+
+    encode32_t f = __atomic_load_n(&encode32, __ATOMIC_RELAXED);
+    if (f) return f;
+
+    f = encode32_scalar;
+#ifdef __SSE2__
+    f = encode32_sse2;
+#endif
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) f = encode32_avx2;
+#endif
+
+    __atomic_store_n(&encode32, f, __ATOMIC_RELAXED);
+    return f;
+}
+
+
+uint32_t twobit_encode32(const char* seqstr, kmer_t* x)
+{
+    return get_encode32()(seqstr, x);
+}
+
+
+size_t twobit_append_n_ambig(twobit_t* s, const char* seqstr, size_t seqlen,
+                             uint64_t* ambig)
 {
     twobit_reserve(s, seqlen);
 
-    kmer_t c;
-    size_t idx, off;
+    if (ambig) memset(ambig, 0, ((seqlen + 63) / 64) * sizeof(uint64_t));
+
+    encode32_t encode32 = get_encode32();
+    size_t ambig_count = 0;
+    size_t idx = s->len / (4 * sizeof(kmer_t));
+    size_t off = s->len % (4 * sizeof(kmer_t));
+    uint32_t a;
+    kmer_t x;
     size_t i;
-    for (i = 0; i < seqlen; ++i) {
-        c = chartokmer[(uint8_t) seqstr[i]];
-        if (c > 3) continue;
+
+    /* Whole limbs' worth at a time. */
+    for (i = 0; i + 32 <= seqlen; i += 32, ++idx) {
+        a = encode32(seqstr + i, &x);
+        ambig_count += __builtin_popcount(a);
+        if (ambig) ambig[i / 64] |= (uint64_t) a << (i % 64);
+
+        if (off == 0) s->seq[idx] = x;
+        else {
+            s->seq[idx] = (s->seq[idx] & (((kmer_t) 1 << (2 * off)) - 1)) |
+                          (x << (2 * off));
+            s->seq[idx + 1] = x >> (64 - 2 * off);
+        }
+    }
+
+    /* The remainder, one at a time. */
+    kmer_t c;
+    for (; i < seqlen; ++i) {
+        if (isnuc(seqstr[i])) c = chartokmer[(uint8_t) seqstr[i]];
+        else {
+            c = 0;
+            ++ambig_count;
+            if (ambig) ambig[i / 64] |= (uint64_t) 1 << (i % 64);
+        }
 
         idx = (s->len + i) / (4 * sizeof(kmer_t));
         off = (s->len + i) % (4 * sizeof(kmer_t));
@@ -135,6 +302,7 @@ void twobit_append_n(twobit_t* s, const char* seqstr, size_t seqlen)
     }
 
     s->len += seqlen;
+    return ambig_count;
 }
 
 
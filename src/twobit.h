@@ -35,6 +35,18 @@ void   twobit_copy_str_n(twobit_t*, const char*, size_t);
 void   twobit_append(twobit_t*, const char*);
 void   twobit_append_char(twobit_t*, char);
 void   twobit_append_n(twobit_t*, const char*, size_t);
+
+/* Append n nucleotides, also marking the positions in the string that are not
+ * A, C, G, or T as set bits in ambig, which must have room for (n + 63) / 64
+ * words. Ambiguous nucleotides are stored as A.
+ *
+ * Returns the number of ambiguous nucleotides. */
+size_t twobit_append_n_ambig(twobit_t*, const char*, size_t n, uint64_t* ambig);
+
+/* Pack the 32 nucleotides at seqstr into x, the first in the low bits,
+ * returning a mask of the positions that are not A, C, G, or T, which are
+ * packed as A. Exactly 32 characters are read. */
+uint32_t twobit_encode32(const char* seqstr, kmer_t* x);
 void   twobit_append_kmer(twobit_t*, kmer_t x, size_t k);
 void   twobit_append_twobit(twobit_t*, const twobit_t*);
 void   twobit_reverse(twobit_t*);